@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <chrono>
 
 
 namespace lsc
@@ -23,6 +24,37 @@ namespace lsc
 				const std::vector<std::string>& args)
 			= 0;
 		virtual operator bool() const = 0;
+		// Called every tick of the show loop, for work that can't wait
+		virtual void poll() { }
+		/* A descriptor that turns readable when the controller has news -- a
+		   step being over, say -- for the show loop to wake on and `poll` for
+		   rather than waiting out the tick; -1 for none. */
+		virtual int pollFd() const { return -1; }
+
+		/* Identifies what the last `execute` started, so `completed` can say
+		   when it's over -- when its fades have landed, say.  Controllers whose
+		   instructions take effect at once are always complete. */
+		virtual size_t lastCommand() const { return 0; }
+		virtual bool completed(size_t) { return 1; }
+
+		/* Has instructions executed from here on take effect at `when`
+		   rather than as they come, so a group of them lands together.  A
+		   default-constructed time goes back to taking effect at once. */
+		virtual void executeAt(std::chrono::steady_clock::time_point when) { }
+
+		/* Works an instruction out ahead of time and holds it ready to take
+		   effect on `commit`, or forgets it on `discard`.  Returns whether it
+		   could; one that couldn't has to be executed when its time comes. */
+		virtual bool prepare(
+				const std::string& inst,
+				const std::vector<std::string>& args)
+		{ return 0; }
+		virtual void commit() { }
+		virtual void discard() { }
+
+		/* Takes everything dark right away, ahead of anything still on its
+		   way out, and stops whatever is moving. */
+		virtual void panic() { }
 
 		virtual ~Controller() { }
 	};
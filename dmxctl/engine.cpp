@@ -0,0 +1,1900 @@
+#include "engine.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cctype>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <termios.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <random>
+#include <memory>
+#include <mutex>
+
+
+namespace lsc::engine
+{
+	using namespace std::literals::chrono_literals;
+	using Clock = std::chrono::steady_clock;
+
+	using byte = unsigned char;
+
+	constexpr auto kMinRefr = 20ms;
+	constexpr unsigned kDefaultRate = 44; //Frames per second; a full DMX universe
+	                                      //can't go out much faster than this
+	using lsc::proto::kSlots;
+
+	/* Easing profiles a fade can follow, as tables from Q0.16 progress (in steps
+	   of 2^-12) to Q0.16 position, so any of them costs one lookup per slot.  The
+	   linear one is never actually looked up. */
+	enum Curve : byte { linear, scurve, square, logarithmic, kCurves };
+	constexpr size_t kCurveSteps = 4096;
+	uint32_t curveTables[kCurves][kCurveSteps + 1];
+	void buildCurves();
+
+	// One cycle of each effect waveform, from Q0.12 phase to Q0.16 value
+	enum class Wave : byte { sine, saw, triangle, square, strobe };
+	constexpr size_t kWaves = 5;
+	constexpr size_t kWaveSteps = 4096;
+	uint32_t waveTables[kWaves][kWaveSteps];
+	void buildWaves();
+
+	struct State
+	{
+		/* One row per slot across a set of flat arrays, so a single branch-free
+		   pass steps every fade in every universe.  Positions are fixed-point with 16
+		   fractional bits and progress is worked out from the fade's start rather
+		   than accumulated, so a fade lands on its target exactly at its deadline
+		   however late the frame that notices it is.
+
+		   A 16- or 24-bit parameter split over adjacent slots is faded as one value
+		   in the row of its lowest slot; `owner` maps each of its slots back to
+		   that row. */
+		struct Faders
+		{
+			static constexpr int kMaxWidth = 3;
+
+			std::vector<int64_t>  pos;
+			std::vector<int64_t>  from;
+			std::vector<int64_t>  delta;
+			std::vector<int64_t>  start; //us on Clock
+			std::vector<int64_t>  dur;   //us
+			std::vector<int64_t>  rate;  //2^48 / dur
+			std::vector<byte>     active;
+			std::vector<byte>     width;
+			std::vector<byte>     lsbFirst;
+			std::vector<byte>     curve;
+			std::vector<uint16_t> owner;
+			size_t  count;
+			size_t  wide; //Rows with width > 1
+			int64_t latest; //When the last fade started since it was zeroed lands
+
+			explicit Faders(size_t slots);
+
+			// Slot holding byte k (0 is most significant) of row i's value
+			size_t slotOf(size_t i, int k) const
+			{ return lsbFirst[i] ? i + width[i]-1 - k : i + k; }
+
+			/* Fades the w-byte value at slots [i, i+w) to tgt, starting at `at`.
+			   Levels supplies the starting point when the row isn't already fading
+			   the same way.  A zero-length fade that starts later is a jump. */
+			void fade(size_t i, int64_t at, int64_t dur,
+					int w, bool lsbFirst, uint32_t tgt, const uint16_t* levels,
+					Curve = linear);
+			void cancel(size_t);
+			void step(int64_t now, uint16_t* levels);
+
+		private:
+			void release(size_t); //Hands a wide row's slots back to themselves
+		};
+
+		/* Every universe's slots, kSlots to each and numbered straight through
+		   them, so everything below runs over all of them in one pass. */
+		size_t universes;
+		size_t size;
+
+		/* The universes are rendered as Q8.8 levels and only cut down to bytes on
+		   the way out, carrying each slot's rounding error over to its next frame
+		   so a level between two DMX values comes out as the right average of
+		   them. */
+		std::vector<uint16_t> levels;
+		std::vector<byte> residue;
+		std::vector<uint16_t> fx; //render's, for the levels with effects on
+		bool dithering; //Some level has a fractional part
+
+		/* Each slot's dimmer response, as an index into a run of 65536-entry
+		   level-to-level tables applied just before quantizing.  Table 0 passes
+		   levels through untouched. */
+		std::vector<byte> response;
+		std::vector<uint16_t> responses;
+
+		/* The grand master (row 0) and submasters, as Q0.16 factors with 1 at
+		   65536, fading the same way slots do.  Slots not in a group are left
+		   alone; group g scales by the grand master and submaster g-1, where
+		   submaster 0 is the always-full "none". */
+		struct Masters
+		{
+			static constexpr size_t kMasters = 64;
+
+			uint32_t level[kMasters];
+			int64_t  from[kMasters];
+			int64_t  delta[kMasters];
+			int64_t  start[kMasters];
+			int64_t  dur[kMasters];
+			int64_t  rate[kMasters];
+			byte     curve[kMasters];
+			byte     active[kMasters];
+			size_t   count;
+			int64_t  latest; //As for Faders
+
+			Masters();
+
+			void fade(size_t, int64_t now, int64_t dur, uint32_t tgt, Curve = linear);
+			void step(int64_t now);
+		};
+		Masters masters;
+		std::vector<byte> group;
+
+		/* Periodic modulation laid over the levels at render time, leaving the
+		   levels themselves alone.  Every (effect, slot) pair is a member row; an
+		   effect's members share its waveform, period and depth but each has its
+		   own phase, which is how a chase spreads across instruments. */
+		struct Effects
+		{
+			static constexpr size_t kEffects = 256;
+			static constexpr size_t kMembers = 4096;
+			enum Mode : byte { scale, offset };
+
+			int64_t  start[kEffects]; //us on Clock
+			uint64_t rate[kEffects];  //Q0.64 cycles per us
+			uint32_t depth[kEffects]; //Q0.16
+			byte     wave[kEffects];
+			byte     mode[kEffects];
+
+			uint16_t slot[kMembers];
+			byte     effect[kMembers];
+			uint32_t phase[kMembers]; //Q0.32 cycles
+			uint32_t value[kMembers]; //This frame's waveform value
+			size_t   count;
+
+			Effects() : start{0}, rate{0}, depth{0}, wave{0}, mode{0}, slot{0},
+				effect{0}, phase{0}, value{0}, count{0} { }
+
+			void remove(byte id);
+			// Returns 0 when out of member rows
+			bool add(byte id, size_t slot, uint32_t phase);
+			void apply(int64_t now, uint16_t* levels);
+		};
+		Effects effects;
+
+		/* How the patch lays values over slots, for fades the child plans itself.
+		   A multi-byte value's first slot has its width in the high nybble and
+		   kLsbFirst set if its fine byte comes first; kDiscrete marks slots that
+		   jump rather than fade, and kIntensity those a panic takes to zero. */
+		static constexpr byte kLsbFirst = 1, kDiscrete = 2, kIntensity = 4;
+		std::vector<byte> layout;
+		// Which slots a panic takes dark: laid out as such, or under a master
+		void intensity(std::vector<bool>& out) const;
+
+		/* The frames as they go out, kFrame bytes to a universe, each
+		   starting with its start code */
+		std::vector<byte> slots;
+		std::vector<uint16_t> length; //Slots each actually sends, after the start code
+		// Where slot i sits in the frames
+		static size_t at(size_t i)
+		{ return i / kSlots * kFrame + 1 + i % kSlots; }
+		Clock::duration period; //Between frames while anything is changing
+		Faders faders;
+		int64_t now; //us on Clock; the frame commands are being applied to
+		bool updated;
+		bool supressBadAddr;
+		int terminal; //Where commands come from, if that's a tty to echo on
+		lsc::proto::Shared* shared; //Null when not started by DmxCtl
+
+		/* Batches the parent has marked since the last write, to be acknowledged
+		   with the number and time of the first frame that carries them. */
+		struct Mark { uint32_t id; bool binary; };
+		std::vector<Mark> marks;
+		/* Marked batches with fades still running, to be reported done once the
+		   last fade each one started has landed. */
+		struct Watch { uint32_t id; bool binary; int64_t end; };
+		std::vector<Watch> watches;
+		uint32_t frame; //Frames sent so far
+
+		/* Commands held for a time of the parent's choosing, on the same steady
+		   clock, and applied as of that time in the first frame at or after it. */
+		struct Scheduled { char op; bool binary; std::string body; };
+		static constexpr size_t kMaxScheduled = 4096;
+		std::multimap<int64_t, Scheduled> scheduled; //Same-time ones stay in order
+		// Commands prepared ahead of time, applied together on a `G`
+		std::vector<Scheduled> staged;
+
+		/* A panic comes out of band, ahead of anything still queued, and holds
+		   every frame at `frozen` -- the output as it stood, with every slot
+		   but those set to hold at zero -- until the `Z` the parent queues
+		   behind it arrives.  By then everything sent before the panic has
+		   been applied and the parent has taken the same slots down itself. */
+		uint32_t panicked; //The latest panic seen
+		bool frozenOut;
+		std::vector<byte> frozen;
+		void panic();
+		void mirror(const std::vector<byte>& frames)
+		{
+			if (!shared)
+				return;
+			for (size_t u = 0; u < universes; u++)
+			{
+				std::memcpy(shared->output[u].begin(), &frames[u * kFrame + 1], kSlots);
+				shared->output[u].publish();
+			}
+		}
+
+		explicit State(size_t u) : universes{u}, size{u * kSlots}, levels(size),
+			residue(size), fx(size), dithering{0}, response(size), responses(1 << 16),
+			masters{}, group(size), layout(size), slots(u * kFrame), length(u, kSlots),
+			period{Clock::duration{1s} / kDefaultRate}, faders{size}, now{0},
+			updated{1}, supressBadAddr{1}, terminal{-1}, shared{nullptr}, marks{}, watches{},
+			frame{0}, scheduled{}, staged{}, panicked{0}, frozenOut{0}, frozen(u * kFrame)
+		{
+			for (size_t l = 0; l < responses.size(); l++)
+				responses[l] = l;
+		}
+
+		void set(size_t i, byte b)
+		{
+			faders.cancel(faders.owner[i]);
+			levels[i] = (uint16_t)b << 8;
+		}
+		/* Fades the first n slots to target over dur, discrete ones jumping once
+		   snap/255 of the way through. */
+		void crossfade(const byte* target, size_t n, int64_t dur, Curve, unsigned snap);
+		// Expands a response given as levels spread evenly over the input range
+		void defineResponse(byte id, const std::vector<byte>& points);
+		// Returns whether any output byte changed
+		bool render();
+		// Whether the next frame could differ from the last one
+		bool changing() const
+		{
+			return updated || faders.count || masters.count || effects.count ||
+				dithering;
+		}
+		Clock::duration keepalive() const
+		{ return period > kMinRefr ? period : Clock::duration{kMinRefr}; }
+	};
+
+	// One command as it arrived, either a text line or a binary record
+	struct Command
+	{
+		char op;
+		bool binary;
+		std::string_view body; //After the opcode, or the payload
+	};
+
+	/* Drains a link a buffer at a time and hands out the complete
+	   commands in it, text and binary alike, without copying them anywhere. */
+	struct CommandReader
+	{
+		static constexpr size_t kCap = lsc::proto::kMaxLine; //Room for the largest command
+
+		char buf[kCap];
+		size_t begin, end;
+		bool overlong; //Discarding the rest of a line that didn't fit
+
+		CommandReader() : begin{0}, end{0}, overlong{0} { }
+
+		/* Reads what there's room for, without waiting.  Returns 0 once the
+		   other end has hung up. */
+		bool fill(Link&);
+		// Whether the last fill stopped for want of room, not of input
+		bool full() const { return end == kCap; }
+		// Returns 0 when no complete command remains in the buffer.
+		bool next(Command&);
+	};
+
+	std::string doCommand(Command, State&);
+	Clock::time_point nextDeadline(
+			const State&, Clock::time_point lastWrite, Clock::time_point lastFrame);
+	void armTimer(int, Clock::time_point);
+
+	template <typename DT, typename DF>
+	inline constexpr typename DT::rep numberOf(DF d)
+	{ return std::chrono::duration_cast<DT>(d).count(); }
+	inline int64_t micros(Clock::time_point t)
+	{ return numberOf<std::chrono::microseconds>(t.time_since_epoch()); }
+
+
+	std::once_flag tablesBuilt;
+
+	int run(const std::vector<Sink*>& sinks, size_t universes, Link& link,
+			lsc::proto::Shared* shared)
+	{
+		std::call_once(tablesBuilt, []{ buildCurves(); buildWaves(); });
+
+		/* Sleep until either the link has something for us or the fader engine
+		   (or the keepalive refresh) wants a frame. */
+		int ep = epoll_create1(0);
+		int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		auto finish = [&](int code)
+		{
+			if (tfd != -1)
+				close(tfd);
+			if (ep != -1)
+				close(ep);
+			return code;
+		};
+		if (ep == -1 || tfd == -1)
+		{
+			const char cerrstr[] = "failed to set up event loop\n";
+			write(2, cerrstr, sizeof(cerrstr)-1);
+			return finish(1);
+		}
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = link.wake;
+		epoll_ctl(ep, EPOLL_CTL_ADD, link.wake, &ev);
+		ev.data.fd = tfd;
+		epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
+
+		auto input = std::make_unique<CommandReader>(); //Too big for a thread's stack
+		std::string errstr;
+		auto state = std::make_unique<State>(universes);
+		state->shared = shared;
+		if (isatty(link.wake))
+			state->terminal = link.wake;
+		auto lastWrite = Clock::now();
+		auto lastFrame = lastWrite;
+		bool binary = 1; //As the parent last spoke, for events it didn't ask for
+
+		// Every sink gets the one set of frames; returns when they went out
+		auto output = [&](const std::vector<byte>& frames)
+		{
+			auto written = Clock::now();
+			int64_t us = micros(written);
+			Frames out{frames.data(), state->length.data(), state->universes};
+			for (auto sink : sinks)
+				if (!sink->send(out, us) &&
+						(errno != EFAULT || !state->supressBadAddr))
+				{
+					std::string errstr = sink->describe();
+					errstr += ": ";
+					errstr += strerror(errno);
+					errstr += "\n";
+					write(2, errstr.c_str(), errstr.size());
+				}
+			lastWrite = Clock::now();
+			++state->frame;
+			return written;
+		};
+
+		/* Checked on every wake and between commands, so a panic is on the wire
+		   within a frame however much is queued: the signal or eventfd behind it
+		   interrupts the wait, and the timer never sleeps longer than a frame
+		   anyway. */
+		auto checkPanic = [&]
+		{
+			uint32_t seq = link.panic.load(std::memory_order_acquire);
+			if (seq == state->panicked)
+				return;
+			state->panicked = seq;
+			state->panic();
+			auto written = output(state->frozen);
+			std::string out = lsc::proto::Message{binary, 'z'}
+				.num(seq, 4).num(state->frame, 4).num(micros(written), 8)
+				.str();
+			link.write(out.data(), out.size());
+		};
+		/* A panic signal landing after the last check but before the wait
+		   would sit unseen until the timer fires, which may be seconds away.
+		   It's held off across that gap and let in by the wait itself. */
+		sigset_t panicSet, runMask, waitMask;
+		sigemptyset(&panicSet);
+		if (link.panicSignal)
+			sigaddset(&panicSet, link.panicSignal);
+		pthread_sigmask(SIG_SETMASK, nullptr, &runMask);
+		waitMask = runMask;
+		if (link.panicSignal)
+			sigdelset(&waitMask, link.panicSignal);
+		for(;;)
+		{
+			armTimer(tfd, nextDeadline(*state, lastWrite, lastFrame));
+
+			epoll_event evs[2];
+			if (link.panicSignal)
+			{
+				pthread_sigmask(SIG_BLOCK, &panicSet, nullptr);
+				checkPanic();
+			}
+			int nev = epoll_pwait(ep, evs, 2, -1, &waitMask);
+			int waitErr = errno;
+			if (link.panicSignal)
+				pthread_sigmask(SIG_SETMASK, &runMask, nullptr);
+			if (nev == -1 && waitErr != EINTR)
+			{
+				std::string errstr = "epoll_pwait: ";
+				errstr += strerror(waitErr);
+				errstr += '\n';
+				write(2, errstr.c_str(), errstr.size());
+				return finish(1);
+			}
+
+			//Commands and faders in this frame all see the same instant
+			auto now = Clock::now();
+			state->now = micros(now);
+
+			checkPanic();
+			bool hungUp = 0;
+			for (int e = 0; e < nev; e++)
+			{
+				if (evs[e].data.fd == tfd)
+				{
+					uint64_t expirations;
+					read(tfd, &expirations, sizeof(expirations));
+					continue;
+				}
+
+				/* Everything that has arrived is applied before the next frame,
+				   a bufferful at a time. */
+				for (bool more = 1; more; )
+				{
+					if (!input->fill(link))
+						hungUp = 1;
+					more = !hungUp && input->full();
+					for (Command comm; input->next(comm); )
+					{
+						checkPanic();
+						binary = comm.binary;
+						errstr = doCommand(comm, *state);
+						if (errstr.size())
+						{
+							errstr += '\n';
+							write(2, errstr.c_str(), errstr.size());
+						}
+					}
+				}
+			}
+			if (hungUp) //Parent closed its end; nothing more will come.
+				return finish(0);
+
+			/* Whatever arrives between frames waits for the next one, so any amount
+			   of it goes out in a single write. */
+			if (now < nextDeadline(*state, lastWrite, lastFrame))
+				continue;
+
+			for (auto s = state->scheduled.begin();
+					s != state->scheduled.end() && s->first <= state->now;
+					s = state->scheduled.erase(s))
+			{
+				int64_t frameTime = state->now;
+				state->now = s->first;
+				errstr = doCommand({s->second.op, s->second.binary, s->second.body}, *state);
+				state->now = frameTime;
+				if (errstr.size())
+				{
+					errstr += '\n';
+					write(2, errstr.c_str(), errstr.size());
+				}
+			}
+
+			state->faders.step(state->now, state->levels.data());
+			state->masters.step(state->now);
+			if (state->render())
+				state->updated = 1;
+			if (state->updated && !state->frozenOut)
+				state->mirror(state->slots);
+			lastFrame += state->period;
+			if (lastFrame + state->period < now) //Fell behind, or was idle
+				lastFrame = now;
+
+
+			if (state->updated || lastWrite + state->keepalive() <= now)
+			{
+				state->updated = 0;
+				auto written = output(state->frozenOut ? state->frozen : state->slots);
+
+				for (auto& mark : state->marks)
+				{
+					std::string ack = lsc::proto::Message{mark.binary, 'a'}
+						.num(mark.id, 4).num(state->frame, 4).num(micros(written), 8)
+						.str();
+					link.write(ack.data(), ack.size()); //Dropped if nobody's reading
+				}
+				state->marks.clear();
+			}
+
+			//Batches whose fades have all landed, as of what's on the wire now
+			for (size_t w = 0; w < state->watches.size(); )
+			{
+				auto& watch = state->watches[w];
+				if (watch.end > state->now)
+				{
+					w++;
+					continue;
+				}
+				std::string done = lsc::proto::Message{watch.binary, 'd'}
+					.num(watch.id, 4).num(state->frame, 4).num(state->now, 8)
+					.str();
+				link.write(done.data(), done.size());
+				watch = state->watches.back();
+				state->watches.pop_back();
+			}
+		}
+	}
+
+
+
+	Clock::time_point nextDeadline(
+			const State& state, Clock::time_point lastWrite, Clock::time_point lastFrame)
+	{
+		auto next = lastWrite + state.keepalive();
+		if (state.changing() && lastFrame + state.period < next)
+			next = lastFrame + state.period;
+		else if (state.scheduled.size())
+		{
+			//Nothing's running on the frame clock, so wake just when it's due
+			Clock::time_point due{std::chrono::microseconds{state.scheduled.begin()->first}};
+			if (due < next)
+				next = due;
+		}
+		return next;
+	}
+
+	void buildCurves()
+	{
+		for (size_t i = 0; i <= kCurveSteps; i++)
+		{
+			double p = (double)i / kCurveSteps;
+			double shaped[kCurves] = {
+				p,
+				p * p * (3 - 2*p),
+				p * p,
+				std::log10(1 + 9*p)
+			};
+			for (size_t c = 0; c < kCurves; c++)
+				curveTables[c][i] = std::lround(shaped[c] * 65536);
+		}
+	}
+
+	void buildWaves()
+	{
+		for (size_t i = 0; i < kWaveSteps; i++)
+		{
+			double p = (double)i / kWaveSteps;
+			double shaped[kWaves] = {
+				0.5 - 0.5 * std::cos(2 * M_PI * p), //Starts at the bottom like the rest
+				p,
+				p < 0.5 ? 2*p : 2 - 2*p,
+				p < 0.5 ? 1.0 : 0.0,
+				p < 0.125 ? 1.0 : 0.0
+			};
+			for (size_t w = 0; w < kWaves; w++)
+				waveTables[w][i] = std::lround(shaped[w] * 65536);
+		}
+	}
+
+	State::Faders::Faders(size_t n)
+		: pos(n), from(n), delta(n), start(n), dur(n), rate(n), active(n),
+		  width(n, 1), lsbFirst(n), curve(n), owner(n), count{0}, wide{0}, latest{0}
+	{
+		for (size_t i = 0; i < n; i++)
+			owner[i] = i;
+	}
+
+	void State::Faders::fade(size_t i, int64_t at, int64_t d,
+			int w, bool lsb, uint32_t tgt, const uint16_t* levels, Curve c)
+	{
+		if (!active[i] || width[i] != w || lsbFirst[i] != lsb)
+		{
+			//Take over every slot involved from whatever was fading it
+			for (size_t s = i; s < i + w; s++)
+			{
+				cancel(owner[s]);
+				cancel(s);
+			}
+
+			width[i] = w;
+			lsbFirst[i] = lsb;
+			int64_t v = 0;
+			for (int k = 0; k < w-1; k++)
+				v = v << 8 | levels[slotOf(i, k)] >> 8;
+			v = v << 16 | levels[slotOf(i, w-1)];
+			pos[i] = v << 8;
+
+			for (size_t s = i; s < i + w; s++)
+				owner[s] = i;
+			wide += w > 1;
+			active[i] = 1;
+			++count;
+		}
+		from[i]  = pos[i];
+		delta[i] = ((int64_t)tgt << 16) - from[i];
+		start[i] = at;
+		dur[i]   = d;
+		latest   = std::max(latest, at + d);
+		rate[i]  = d ? (int64_t{1} << 48) / d : 0;
+		curve[i] = c;
+	}
+
+	void State::Faders::cancel(size_t i)
+	{
+		count -= active[i];
+		active[i] = 0;
+		release(i);
+	}
+
+	void State::Faders::release(size_t i)
+	{
+		if (width[i] > 1)
+		{
+			for (size_t s = i; s < i + width[i]; s++)
+				owner[s] = s;
+			width[i] = 1;
+			--wide;
+		}
+	}
+
+	void State::Faders::step(int64_t now, uint16_t* levels)
+	{
+		if (!count)
+			return;
+
+		size_t left = 0, n = pos.size();
+		for (size_t i = 0; i < n; i++)
+		{
+			int64_t e = now - start[i];
+			bool done = e >= dur[i];
+			e = e < 0 ? 0 : e > dur[i] ? dur[i] : e;
+			int64_t p = done ? int64_t{1} << 16 : (e * rate[i]) >> 32; //Q0.16
+			int64_t q = curveTables[curve[i]][p >> 4];
+			p = curve[i] == linear ? p : q;
+			int64_t np = from[i] + ((delta[i] * p) >> 16);
+			np = active[i] ? np : pos[i];
+
+			levels[i] = active[i] ? (np + (1 << 7)) >> 8 : levels[i];
+			pos[i] = np;
+			active[i] &= !done;
+			left += active[i];
+		}
+		count = left;
+
+		//Spread multi-byte values back out over their slots
+		for (size_t i = 0; wide && i < n; i++)
+		{
+			if (width[i] == 1)
+				continue;
+
+			int64_t v = (pos[i] + (1 << 7)) >> 8;
+			int w = width[i];
+			for (int k = 0; k < w-1; k++)
+				levels[slotOf(i, k)] = (v >> 8*(w-k) & 0xFF) << 8;
+			levels[slotOf(i, w-1)] = v;
+
+			if (!active[i])
+				release(i);
+		}
+	}
+
+	void State::defineResponse(byte id, const std::vector<byte>& points)
+	{
+		constexpr uint32_t kFull = 0xFF00; //Level of DMX 255
+		if (responses.size() < (size_t)(id + 1) << 16)
+			responses.resize((size_t)(id + 1) << 16);
+
+		uint16_t* table = responses.data() + ((size_t)id << 16);
+		uint32_t segs = points.size() - 1;
+		for (uint32_t l = 0; l < 1 << 16; l++)
+		{
+			uint32_t t = (l < kFull ? l : kFull) * segs;
+			uint32_t k = t / kFull, r = t % kFull;
+			if (k == segs)
+				table[l] = points[k] << 8;
+			else
+				table[l] = (points[k] << 8) +
+					(int64_t)(points[k+1] - points[k]) * 256 * r / kFull;
+		}
+	}
+
+	void State::crossfade(const byte* target, size_t n, int64_t d, Curve c, unsigned snap)
+	{
+		int64_t snapAt = now + d * snap / 0xFF;
+		for (size_t i = 0; i < n; )
+		{
+			int w = layout[i] >> 4 ? layout[i] >> 4 : 1;
+			bool lsb = layout[i] & kLsbFirst;
+			if (i + w > n) //Value cut off by the end of the target
+				w = 1;
+
+			uint32_t tgt = 0;
+			for (int k = 0; k < w; k++)
+				tgt = tgt << 8 | target[i + (lsb ? w-1 - k : k)];
+			if (layout[i] & kDiscrete)
+				faders.fade(i, snapAt, 0, w, lsb, tgt, levels.data());
+			else
+				faders.fade(i, now, d, w, lsb, tgt, levels.data(), c);
+			i += w;
+		}
+	}
+
+	State::Masters::Masters()
+		: level{0}, from{0}, delta{0}, start{0}, dur{0}, rate{0}, curve{0},
+		  active{0}, count{0}, latest{0}
+	{
+		for (auto& l : level)
+			l = 1 << 16;
+	}
+
+	void State::Masters::fade(size_t k, int64_t now, int64_t d, uint32_t tgt, Curve c)
+	{
+		count += !active[k];
+		active[k] = 1;
+		from[k]  = level[k];
+		delta[k] = (int64_t)tgt - from[k];
+		start[k] = now;
+		dur[k]   = d;
+		latest   = std::max(latest, now + d);
+		rate[k]  = d ? (int64_t{1} << 48) / d : 0;
+		curve[k] = c;
+	}
+
+	void State::Masters::step(int64_t now)
+	{
+		if (!count)
+			return;
+
+		size_t left = 0;
+		for (size_t k = 0; k < kMasters; k++)
+		{
+			int64_t e = now - start[k];
+			e = e < 0 ? 0 : e > dur[k] ? dur[k] : e;
+			bool done = e == dur[k];
+			int64_t p = done ? int64_t{1} << 16 : (e * rate[k]) >> 32;
+			int64_t q = curveTables[curve[k]][p >> 4];
+			p = curve[k] == linear ? p : q;
+
+			level[k] = active[k] ? from[k] + ((delta[k] * p) >> 16) : level[k];
+			active[k] &= !done;
+			left += active[k];
+		}
+		count = left;
+	}
+
+	void State::Effects::remove(byte id)
+	{
+		size_t kept = 0;
+		for (size_t m = 0; m < count; m++)
+		{
+			if (effect[m] == id)
+				continue;
+			slot[kept]   = slot[m];
+			effect[kept] = effect[m];
+			phase[kept]  = phase[m];
+			++kept;
+		}
+		count = kept;
+	}
+
+	bool State::Effects::add(byte id, size_t s, uint32_t ph)
+	{
+		if (count == kMembers)
+			return 0;
+		slot[count]   = s;
+		effect[count] = id;
+		phase[count]  = ph;
+		++count;
+		return 1;
+	}
+
+	void State::Effects::apply(int64_t now, uint16_t* levels)
+	{
+		for (size_t m = 0; m < count; m++)
+		{
+			byte e = effect[m];
+			//Whole cycles wrap away; the top 32 bits of the fraction are the phase
+			uint32_t ph = ((uint64_t)(now - start[e]) * rate[e] >> 32) + phase[m];
+			value[m] = waveTables[wave[e]][ph >> 20];
+		}
+
+		//Several effects may land on one slot, so this part stays in order
+		for (size_t m = 0; m < count; m++)
+		{
+			byte e = effect[m];
+			uint16_t& l = levels[slot[m]];
+			if (mode[e] == scale)
+				l = l * ((1 << 16) - depth[e] + ((uint64_t)depth[e] * value[m] >> 16)) >> 16;
+			else
+			{
+				//Swings depth either side of the level, in whole-range units
+				int64_t d = ((int64_t)value[m] - (1 << 15)) * depth[e] >> 15;
+				int32_t nl = l + (d * 0xFF00 >> 16);
+				l = nl < 0 ? 0 : nl > 0xFF00 ? 0xFF00 : nl;
+			}
+		}
+	}
+
+	void State::intensity(std::vector<bool>& out) const
+	{
+		out.resize(size);
+		for (size_t i = 0; i < size; )
+		{
+			int w = layout[i] >> 4 ? layout[i] >> 4 : 1;
+			bool on = group[i] || layout[i] & kIntensity;
+			for (int k = 0; k < w && i < size; k++)
+				out[i++] = on;
+		}
+	}
+
+	void State::panic()
+	{
+		for (size_t i = 0; i < size; i++)
+			if (faders.active[i])
+				faders.cancel(i);
+		std::fill(std::begin(masters.active), std::end(masters.active), 0);
+		masters.count = 0;
+		effects.count = 0;
+		scheduled.clear();
+		staged.clear();
+		for (auto& watch : watches) //Cut short is as landed as they'll get
+			watch.end = now;
+
+		std::vector<bool> dim;
+		intensity(dim);
+		frozen = slots;
+		for (size_t i = 0; i < size; i++)
+			if (dim[i])
+				frozen[at(i)] = 0;
+		frozenOut = 1;
+		mirror(frozen);
+	}
+
+	bool State::render()
+	{
+		std::copy(levels.begin(), levels.end(), fx.begin());
+		effects.apply(now, fx.data());
+
+		//What each group's slots get multiplied by this frame
+		uint32_t scale[Masters::kMasters + 1];
+		scale[0] = 1 << 16;
+		scale[1] = masters.level[0];
+		for (size_t g = 2; g <= Masters::kMasters; g++)
+			scale[g] = (uint64_t)masters.level[0] * masters.level[g-1] >> 16;
+
+		bool changed = 0;
+		uint16_t fractional = 0;
+		for (size_t u = 0, i = 0; u < universes; u++)
+		{
+			byte* out = &slots[u * kFrame + 1];
+			for (size_t s = 0; s < kSlots; s++, i++)
+			{
+				uint16_t scaled = fx[i] * scale[group[i]] >> 16;
+				uint16_t l = responses[(size_t)response[i] << 16 | scaled];
+				unsigned acc = (l & 0xFF) + residue[i];
+				unsigned v = (l >> 8) + (acc >> 8);
+				byte b = v > 0xFF ? 0xFF : v;
+
+				residue[i] = acc & 0xFF;
+				fractional |= l & 0xFF;
+				changed |= b != out[s];
+				out[s] = b;
+			}
+		}
+		dithering = fractional;
+		return changed;
+	}
+
+	std::string openSinks(const std::string& spec,
+			std::vector<std::unique_ptr<Sink>>& out)
+	{
+		size_t universes = universesIn(spec);
+		if (universes > lsc::proto::kMaxUniverses)
+			return "no more than " + std::to_string(lsc::proto::kMaxUniverses) +
+				" universes are supported";
+		size_t universe = 0, opened = 0;
+		for (size_t at = 0; at <= spec.size(); )
+		{
+			size_t end = std::min(spec.find_first_of(",;", at), spec.size());
+			std::string one = spec.substr(at, end - at);
+			bool last = end == spec.size() || spec[end] == ';'; //Of this universe's
+			at = end + 1;
+			size_t before = out.size();
+
+			if (one == "null")
+				out.push_back(std::make_unique<NullSink>());
+			else if (one == "loopback")
+				out.push_back(std::make_unique<LoopbackSink>());
+			else if (one.rfind("file:", 0) == 0)
+			{
+				std::string path = one.substr(5);
+				/* A FIFO opened for reading too never fails for want of a
+				   reader, and never blocks the loop once it's full. */
+				struct stat st;
+				bool fifo = stat(path.c_str(), &st) == 0 && S_ISFIFO(st.st_mode);
+				int fd = fifo
+					? open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC)
+					: open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+				if (fd == -1)
+					return "failed to open " + path + ": " + strerror(errno);
+				out.push_back(std::make_unique<FileSink>(fd, path));
+			}
+			else if (one.rfind("artnet:", 0) == 0 || one.rfind("sacn:", 0) == 0)
+			{
+				bool art = one[0] == 'a';
+				auto protocol = art ? UdpSink::Protocol::artnet : UdpSink::Protocol::sacn;
+				std::string where = one.substr(art ? 7 : 5);
+				//Unless given, as many on from the protocol's first as ours is
+				unsigned long wire = (art ? 0 : 1) + universe;
+				std::string port = std::to_string(
+						art ? UdpSink::kArtNetPort : UdpSink::kSacnPort);
+				try {
+					size_t slash = where.find('/');
+					if (slash != std::string::npos)
+					{
+						wire = std::stoul(where.substr(slash + 1));
+						where.erase(slash);
+					}
+				} catch (...) {
+					return "bad universe in " + one;
+				}
+				if (art ? wire > 0x7FFF : wire < 1 || wire > 63999)
+					return "universe out of range in " + one;
+				size_t colon = where.find(':');
+				if (colon != std::string::npos)
+				{
+					port = where.substr(colon + 1);
+					where.erase(colon);
+				}
+
+				sockaddr_in to{};
+				to.sin_family = AF_INET;
+				to.sin_port = htons(std::atoi(port.c_str()));
+				if (where.empty() && art)
+					to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+				else if (where.empty()) //The universe's multicast group
+					to.sin_addr.s_addr = htonl(0xEFFF0000 | wire);
+				else
+				{
+					addrinfo hints{}, *found;
+					hints.ai_family = AF_INET;
+					hints.ai_socktype = SOCK_DGRAM;
+					if (getaddrinfo(where.c_str(), port.c_str(), &hints, &found))
+						return "failed to look up " + where;
+					to = *(sockaddr_in*)found->ai_addr;
+					freeaddrinfo(found);
+				}
+
+				//Every output of a protocol goes in its one sendmmsg
+				UdpSink* same = nullptr;
+				for (auto& sink : out)
+					if (auto udp = dynamic_cast<UdpSink*>(sink.get());
+							udp && udp->protocol == protocol)
+						same = udp;
+				if (same)
+				{
+					same->name += "+" + one;
+					same->addPort(universe, wire, to);
+					opened++;
+				}
+				else
+				{
+					int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+					if (fd == -1)
+						return "failed to make a socket for " + one + ": " + strerror(errno);
+					int yes = 1;
+					if (art)
+						setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+					auto udp = std::make_unique<UdpSink>(protocol, fd, one);
+					udp->addPort(universe, wire, to);
+					out.push_back(std::move(udp));
+				}
+			}
+			else if (one.size())
+			{
+				int fd = open(one.c_str(), O_WRONLY | O_CLOEXEC);
+				if (fd == -1)
+					return "failed to open device " + one + ": " + strerror(errno);
+				out.push_back(std::make_unique<DeviceSink>(fd, one));
+			}
+
+			opened += out.size() - before;
+			for (; before < out.size(); before++)
+				out[before]->universe = universe;
+			if (last)
+			{
+				if (!opened)
+					return "no output given for universe " + std::to_string(universe);
+				universe++;
+				opened = 0;
+			}
+		}
+		return "";
+	}
+
+	bool FileSink::send(const Frames& f, int64_t us)
+	{
+		const byte* frame = f[universe];
+		size_t n = f.size(universe);
+		byte head[kRecordHeader];
+		for (int b = 0; b < 8; b++)
+			head[b] = us >> 8*b;
+		head[8] = n & 0xFF;
+		head[9] = n >> 8;
+		iovec parts[2] = {{head, sizeof(head)}, {(void*)frame, n}};
+		//Less than PIPE_BUF in all, so a FIFO takes all of it or none
+		if (writev(fd, parts, 2) == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return 0;
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return 1;
+		}
+		frames.fetch_add(1, std::memory_order_relaxed);
+		return 1;
+	}
+
+	bool LoopbackSink::send(const Frames& f, int64_t us)
+	{
+		const byte* frame = f[universe];
+		size_t n = f.size(universe);
+		char rec[kRecordHeader + kFrame];
+		for (int b = 0; b < 8; b++)
+			rec[b] = us >> 8*b;
+		rec[8] = n & 0xFF;
+		rec[9] = n >> 8;
+		std::memcpy(rec + kRecordHeader, frame, n);
+		if (records.room() < kRecordHeader + n)
+			dropped.fetch_add(1, std::memory_order_relaxed);
+		else
+		{
+			records.push(rec, kRecordHeader + n);
+			frames.fetch_add(1, std::memory_order_relaxed);
+		}
+		return 1;
+	}
+
+	const byte UdpSink::zero = 0;
+
+	UdpSink::UdpSink(Protocol p, int f, std::string n)
+		: protocol{p}, fd{f}, name{n}, cid{}
+	{
+		std::random_device random;
+		for (auto& b : cid)
+			b = random();
+		cid[6] = (cid[6] & 0x0F) | 0x40; //Version 4 UUID
+		cid[8] = (cid[8] & 0x3F) | 0x80;
+	}
+
+	void UdpSink::addPort(size_t source, uint16_t universe, const sockaddr_in& to)
+	{
+		static const byte acnId[12] = {
+			'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0
+		};
+		auto& port = ports.emplace_back();
+		port.source = source;
+		port.universe = universe;
+		port.to = to;
+		port.lastLength = 0;
+		port.lastSent = 0;
+		port.sequence = 0;
+
+		/* Everything but the sequence number and lengths, which go in per
+		   packet; all big-endian but Art-Net's opcode. */
+		byte* h = port.header;
+		std::memset(h, 0, kMaxHeader);
+		if (protocol == Protocol::artnet)
+		{
+			std::memcpy(h, "Art-Net", 8);
+			h[9] = 0x50;                      //OpDmx
+			h[11] = 14;                       //Protocol version
+			h[14] = port.universe & 0xFF;     //Sub-Net and Universe
+			h[15] = port.universe >> 8 & 0x7F; //Net
+		}
+		else
+		{
+			h[1] = 0x10;                  //Root layer: preamble size
+			std::memcpy(h + 4, acnId, sizeof(acnId));
+			h[21] = 0x04;                 //Vector: E1.31 data
+			std::memcpy(h + 22, cid, sizeof(cid));
+			h[43] = 0x02;                 //Framing layer vector: data packet
+			std::strncpy((char*)h + 44, "LiveShowControl", 63);
+			h[108] = 100;                 //Priority
+			h[113] = port.universe >> 8;
+			h[114] = port.universe & 0xFF;
+			h[117] = 0x02;                //DMP layer vector: set property
+			h[118] = 0xA1;                //Address and data types
+			h[122] = 0x01;                //Address increment
+		}
+
+		iov.resize(3 * ports.size());
+		msgs.emplace_back().msg_hdr = {};
+	}
+
+	void UdpSink::pack(Port& port, const byte* frame, size_t n, size_t m)
+	{
+		byte* h = port.header;
+		iovec* v = &iov[3 * m];
+		auto& hdr = msgs[m].msg_hdr;
+		hdr.msg_name = &port.to;
+		hdr.msg_namelen = sizeof(port.to);
+		hdr.msg_iov = v;
+		if (protocol == Protocol::artnet)
+		{
+			//No start code, and an even number of slots
+			size_t slots = n - 1;
+			bool odd = slots & 1;
+			port.sequence = port.sequence % 255 + 1; //0 would mean unsequenced
+			h[12] = port.sequence;
+			h[16] = (slots + odd) >> 8;
+			h[17] = (slots + odd) & 0xFF;
+			v[0] = {h, 18};
+			v[1] = {(void*)(frame + 1), slots};
+			v[2] = {(void*)&zero, 1};
+			hdr.msg_iovlen = 2 + odd;
+		}
+		else
+		{
+			//Each layer's flags and length, counted from its own start
+			auto flagsAndLength = [h](size_t at, size_t len)
+			{
+				h[at]     = 0x70 | len >> 8;
+				h[at + 1] = len & 0xFF;
+			};
+			flagsAndLength(16, kMaxHeader + n - 16);
+			flagsAndLength(38, kMaxHeader + n - 38);
+			flagsAndLength(115, kMaxHeader + n - 115);
+			h[111] = port.sequence++;
+			h[123] = n >> 8; //Start code and slots
+			h[124] = n & 0xFF;
+			v[0] = {h, kMaxHeader};
+			v[1] = {(void*)frame, n};
+			hdr.msg_iovlen = 2;
+		}
+	}
+
+	bool UdpSink::send(const Frames& f, int64_t us)
+	{
+		size_t due = 0;
+		for (auto& port : ports)
+		{
+			const byte* frame = f[port.source];
+			size_t n = f.size(port.source);
+			bool changed = n != port.lastLength || std::memcmp(frame, port.last, n);
+			if (!changed && us - port.lastSent < kKeepalive)
+				continue;
+			if (changed)
+			{
+				std::memcpy(port.last, frame, n);
+				port.lastLength = n;
+			}
+			port.lastSent = us;
+			pack(port, frame, n, due++);
+		}
+		if (!due)
+			return 1;
+
+		int sent = sendmmsg(fd, msgs.data(), due, 0);
+		if (sent == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return 0;
+			sent = 0; //The socket's buffer is full; these ones are lost
+		}
+		packets.fetch_add(sent, std::memory_order_relaxed);
+		dropped.fetch_add(due - sent, std::memory_order_relaxed);
+		return 1;
+	}
+
+	size_t LoopbackSink::next(byte (&frame)[kFrame], int64_t* us)
+	{
+		//Records only ever go in whole, so a header means a frame follows
+		byte head[kRecordHeader];
+		if (!records.pop((char*)head, sizeof(head)))
+			return 0;
+		size_t n = lsc::proto::getLE(head + 8, 2);
+		records.pop((char*)frame, n);
+		if (us)
+			*us = lsc::proto::getLE(head, 8);
+		return n;
+	}
+
+	void armTimer(int tfd, Clock::time_point when)
+	{
+		auto ns = numberOf<std::chrono::nanoseconds>(when.time_since_epoch());
+		itimerspec its{};
+		//An all-zero it_value would disarm the timer instead of firing it
+		if (ns <= 0)
+			ns = 1;
+		its.it_value.tv_sec  = ns / 1'000'000'000;
+		its.it_value.tv_nsec = ns % 1'000'000'000;
+		timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, nullptr);
+	}
+
+
+
+	bool CommandReader::fill(Link& link)
+	{
+		for (;;)
+		{
+			if (begin == end)
+				begin = end = 0;
+			else if (end == kCap && begin)
+			{
+				std::memmove(buf, buf + begin, end - begin);
+				end -= begin;
+				begin = 0;
+			}
+			else if (end == kCap)
+			{
+				/* Only called once next() has taken every complete command, so
+				   a full buffer left as it was is one line too long to be a
+				   real command */
+				overlong = 1;
+				begin = end = 0;
+			}
+
+			ssize_t n = link.read(buf + end, kCap - end);
+			switch (n)
+			{
+			case -1:
+				switch (errno)
+				{
+				case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+				case EWOULDBLOCK:
+#endif
+					return 1;
+				case EINTR:
+					continue;
+				case EBADF:
+					throw std::domain_error(
+							std::string{"bad file descriptor: "} + strerror(EBADF)
+						);
+				case EFAULT:
+					throw std::runtime_error(
+							std::string{"impossible error: "} + strerror(EFAULT)
+						);
+				case EINVAL:
+					throw std::domain_error(
+							std::string{"unsuitable file descriptor: "} + strerror(EINVAL)
+						);
+				case EISDIR:
+					throw std::domain_error(
+							std::string{"file descriptor is a directory: "} + strerror(EISDIR)
+						);
+				default:
+					throw std::runtime_error(
+							strerror(errno)
+						);
+				}
+			case 0:
+				return 0;
+			default:
+				end += n; //If that filled it, the rest waits until next() makes room
+				return 1;
+			}
+		}
+	}
+
+	bool CommandReader::next(Command& comm)
+	{
+		namespace proto = lsc::proto;
+		while (begin != end)
+		{
+			if (overlong)
+			{
+				/* Drop the rest of the line, up to its newline or a binary
+				   record, which no text line can contain the start of */
+				size_t k = begin;
+				while (k < end && buf[k] != '\n' && (byte)buf[k] != proto::kMagic)
+					k++;
+				begin = k;
+				if (k == end)
+					return 0;
+				if (buf[k] == '\n')
+					begin++;
+				overlong = 0;
+				const char cerrstr[] = "command too long\n";
+				write(2, cerrstr, sizeof(cerrstr)-1);
+				continue;
+			}
+
+			if ((byte)buf[begin] == proto::kMagic)
+			{
+				if (end - begin < proto::kHeader)
+					return 0;
+				const byte* head = (const byte*)buf + begin;
+				size_t len = proto::getLE(head + 3, 2);
+				if (end - begin < proto::kHeader + len)
+					return 0;
+
+				begin += proto::kHeader + len;
+				if (head[1] != proto::kVersion)
+				{
+					const char cerrstr[] = "unsupported protocol version\n";
+					write(2, cerrstr, sizeof(cerrstr)-1);
+					continue;
+				}
+				comm.op = head[2];
+				comm.binary = 1;
+				comm.body = std::string_view{(const char*)head + proto::kHeader, len};
+				return 1;
+			}
+
+			char* nl = (char*)std::memchr(buf + begin, '\n', end - begin);
+			if (!nl)
+				return 0;
+
+			std::string_view line{buf + begin, (size_t)(nl - (buf + begin))};
+			begin = nl + 1 - buf;
+
+			while (line.size() && std::isspace((unsigned char)line.front()))
+				line.remove_prefix(1);
+			while (line.size() && std::isspace((unsigned char)line.back()))
+				line.remove_suffix(1);
+			if (line.size())
+			{
+				comm.op = line.front();
+				comm.binary = 0;
+				comm.body = line.substr(1);
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+
+	int hexToNybble(char c)
+	{
+		if ('0' <= c && c <= '9')
+			return c - '0';
+		if ('A' <= c && c <= 'F')
+			return c - 'A' + 10;
+		if ('a' <= c && c <= 'f')
+			return c - 'a' + 10;
+		return -1;
+	}
+	bool isBlank(char c)
+	{ return c == ' ' || c == '\t' || c == '\r'; }
+
+	// Pops the next hex digit off the front, skipping blanks.  -1 when exhausted.
+	int takeNybble(std::string_view& sv)
+	{
+		while (sv.size() && isBlank(sv.front()))
+			sv.remove_prefix(1);
+		if (sv.empty() || sv.front() == '\0')
+			return -2;
+		int n = hexToNybble(sv.front());
+		sv.remove_prefix(1);
+		return n;
+	}
+
+	template <typename T>
+	bool takeNumber(std::string_view& sv, T& out)
+	{
+		while (sv.size() && isBlank(sv.front()))
+			sv.remove_prefix(1);
+		auto [p, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), out);
+		if (ec != std::errc{})
+			return 0;
+		sv.remove_prefix(p - sv.data());
+		return 1;
+	}
+
+
+	/* Takes a command's fields off the front in order, whichever form it came in.
+	   Each field's width only matters to the binary form. */
+	struct Args
+	{
+		std::string_view rest;
+		bool binary;
+
+		explicit Args(const Command& comm) : rest{comm.body}, binary{comm.binary} { }
+
+		template <typename T>
+		bool num(T& out, int width)
+		{
+			if (!binary)
+				return takeNumber(rest, out);
+			if (rest.size() < (size_t)width)
+				return 0;
+			out = lsc::proto::getLE((const byte*)rest.data(), width);
+			rest.remove_prefix(width);
+			return 1;
+		}
+
+		/* The next byte of a run, -2 at its end and -1 on junk.  In text a lone
+		   last nybble is a byte by itself. */
+		int takeByte()
+		{
+			if (binary)
+			{
+				if (rest.empty())
+					return -2;
+				byte b = rest.front();
+				rest.remove_prefix(1);
+				return b;
+			}
+			int lo = takeNybble(rest);
+			int hi = lo < 0 ? lo : takeNybble(rest);
+			if (lo < 0 || hi == -1)
+				return lo < 0 ? lo : -1;
+			return hi == -2 ? lo : lo | hi << 4;
+		}
+
+		// A single character: one after any blanks in text, a byte in binary
+		int takeChar()
+		{
+			if (!binary)
+				while (rest.size() && isBlank(rest.front()))
+					rest.remove_prefix(1);
+			if (rest.empty())
+				return -1;
+			char c = rest.front();
+			rest.remove_prefix(1);
+			return (byte)c;
+		}
+
+		// A fade curve: an optional trailing `c<curve>` in text
+		bool curve(unsigned& c)
+		{
+			c = linear;
+			if (binary)
+				return num(c, 1) && c < kCurves;
+			if (done())
+				return 1;
+			return takeChar() == 'c' && takeNumber(rest, c) && c < kCurves;
+		}
+
+		bool done()
+		{
+			if (!binary)
+				while (rest.size() && isBlank(rest.front()))
+					rest.remove_prefix(1);
+			return rest.empty();
+		}
+	};
+
+
+	std::string doCommand(Command comm, State& state)
+	{
+		Args args{comm};
+		char op = comm.op;
+		switch (op)
+		{
+		case '#':
+			state.updated = 1;
+			for (size_t i = 0; i < state.size; i++)
+			{
+				int b = args.takeByte();
+				if (b == -1)
+					return "invalid character in frame command";
+				state.set(i, b == -2 ? 0 : b);
+			}
+			break;
+		case '@': {
+			state.updated = 1;
+			size_t i;
+			if (!args.num(i, 2))
+				return "invalid index";
+			for (int b; (b = args.takeByte()) != -2; i++)
+			{
+				if (state.size <= i)
+					return "index too high";
+				if (b == -1)
+					return "invalid character in index command";
+				state.set(i, b);
+			}
+		} break;
+		case '>': {
+			size_t i, d;
+			if (!args.num(i, 2) || !args.num(d, 4))
+				return "invalid fade command";
+
+			//Target bytes in slot order, coarsest first unless flagged `l`
+			byte target[State::Faders::kMaxWidth];
+			int w = 0;
+			bool lsb = 0;
+			Curve curve = linear;
+			if (args.binary)
+			{
+				//Then a byte of flags: bit 0 for `l`, the curve in the top nybble
+				if (args.rest.size() < 2 || args.rest.size() - 1 > sizeof(target))
+					return "fade needs 1 to 3 whole bytes";
+				for (w = 0; args.rest.size() > 1; w++)
+					target[w] = args.takeByte();
+				byte flags = args.takeByte();
+				lsb = flags & 1;
+				if ((flags >> 4) >= kCurves)
+					return "unknown fade curve";
+				curve = (Curve)(flags >> 4);
+			}
+			else
+			{
+				std::string_view& line = args.rest;
+				while (line.size() && isBlank(line.front()))
+					line.remove_prefix(1);
+				size_t n = 0;
+				while (n < line.size() && hexToNybble(line[n]) != -1)
+					n++;
+				std::string_view hex = line.substr(0, n);
+				line.remove_prefix(n);
+				while (line.size() && isBlank(line.front()))
+					line.remove_prefix(1);
+				for (std::string_view flag; line.size(); )
+				{
+					flag = line.substr(0, line.find(' '));
+					line.remove_prefix(flag.size());
+					while (line.size() && isBlank(line.front()))
+						line.remove_prefix(1);
+
+					unsigned c;
+					if (flag == "l")
+						lsb = 1;
+					else if (flag.size() > 1 && flag.front() == 'c')
+					{
+						flag.remove_prefix(1);
+						if (!takeNumber(flag, c) || flag.size() || c >= kCurves)
+							return "unknown fade curve";
+						curve = (Curve)c;
+					}
+					else
+						return "invalid flag in fade command";
+				}
+
+				w = n / 2;
+				if (n & 1 || w < 1 || w > State::Faders::kMaxWidth)
+					return "fade needs 1 to 3 whole bytes";
+				for (int k = 0; k < w; k++)
+					target[k] = hexToNybble(hex[2*k]) | hexToNybble(hex[2*k+1]) << 4;
+			}
+			if (i + w > state.size)
+				return "invalid index";
+
+			uint32_t tgt = 0;
+			for (int k = 0; k < w; k++)
+				tgt = tgt << 8 | target[lsb ? w-1 - k : k];
+
+			state.faders.fade(i, state.now, d * 1000, w, lsb, tgt, state.levels.data(), curve);
+		} break;
+		case 'F': { //Many fades at once, sharing a duration and curve
+			size_t d;
+			unsigned c;
+			if (!args.num(d, 4) || !args.num(c, 1))
+				return "invalid bulk fade";
+			if (c >= kCurves)
+				return "unknown fade curve";
+
+			/* Every target is checked before any fade starts, so the command
+			   takes effect whole or not at all. */
+			struct Target { size_t i; int w; bool lsb; uint32_t tgt; };
+			std::vector<Target> targets;
+			while (!args.done())
+			{
+				Target t{0, 0, 0, 0};
+				byte b[State::Faders::kMaxWidth];
+				if (!args.num(t.i, 2))
+					return "invalid bulk fade target";
+				if (args.binary)
+				{
+					unsigned flags;
+					if (!args.num(flags, 1))
+						return "invalid bulk fade target";
+					t.lsb = flags & 1;
+					t.w = flags >> 4;
+					if (t.w < 1 || t.w > State::Faders::kMaxWidth)
+						return "fade needs 1 to 3 whole bytes";
+					for (int k = 0; k < t.w; k++)
+					{
+						int v = args.takeByte();
+						if (v < 0)
+							return "invalid bulk fade target";
+						b[k] = v;
+					}
+				}
+				else
+				{
+					std::string_view& line = args.rest;
+					if (line.empty() || line.front() != '=')
+						return "invalid bulk fade target";
+					line.remove_prefix(1);
+					size_t n = 0;
+					while (n < line.size() && hexToNybble(line[n]) != -1)
+						n++;
+					t.w = n / 2;
+					if (n & 1 || t.w < 1 || t.w > State::Faders::kMaxWidth)
+						return "fade needs 1 to 3 whole bytes";
+					for (int k = 0; k < t.w; k++)
+						b[k] = hexToNybble(line[2*k]) | hexToNybble(line[2*k+1]) << 4;
+					line.remove_prefix(n);
+					if (line.size() && line.front() == 'l')
+					{
+						t.lsb = 1;
+						line.remove_prefix(1);
+					}
+				}
+				if (t.i + t.w > state.size)
+					return "invalid index";
+				for (int k = 0; k < t.w; k++)
+					t.tgt = t.tgt << 8 | b[t.lsb ? t.w-1 - k : k];
+				targets.push_back(t);
+			}
+
+			for (auto& t : targets)
+				state.faders.fade(t.i, state.now, d * 1000, t.w, t.lsb, t.tgt,
+						state.levels.data(), (Curve)c);
+		} break;
+		case 'L': { //How a slot's value is laid out
+			size_t i;
+			unsigned flags;
+			if (!args.num(i, 2) || !args.num(flags, 1))
+				return "invalid layout command";
+			int w = flags >> 4 ? flags >> 4 : 1;
+			if (w > State::Faders::kMaxWidth || i + w > state.size)
+				return "invalid layout";
+			state.layout[i] = flags;
+		} break;
+		case 'C': { //Crossfade to a whole look, across every universe
+			size_t d;
+			unsigned c, snap;
+			if (!args.num(d, 4) || !args.num(c, 1) || !args.num(snap, 1))
+				return "invalid crossfade";
+			if (c >= kCurves)
+				return "unknown fade curve";
+			if (snap > 0xFF)
+				return "snap point must be 0 to 255";
+
+			std::vector<byte> target;
+			for (int b; (b = args.takeByte()) != -2; )
+			{
+				if (b < 0)
+					return "invalid character in crossfade";
+				if (target.size() == state.size)
+					return "crossfade target too long";
+				target.push_back(b);
+			}
+			state.crossfade(target.data(), target.size(), d * 1000, (Curve)c, snap);
+		} break;
+		case 'r': { //Define a response curve
+			unsigned id;
+			if (!args.num(id, 1) || id == 0 || id > 0xFF)
+				return "invalid response id";
+
+			std::vector<byte> points;
+			for (int b; (b = args.takeByte()) != -2; )
+			{
+				if (b < 0)
+					return "invalid character in response command";
+				points.push_back(b);
+			}
+			if (points.size() < 2)
+				return "response needs at least two levels";
+			state.defineResponse(id, points);
+			state.updated = 1;
+		} break;
+		case 'R': { //Assign a response curve to a slot
+			size_t i;
+			unsigned id;
+			if (!args.num(i, 2) || !args.num(id, 1))
+				return "invalid response assignment";
+			if (i >= state.size)
+				return "invalid index";
+			if ((size_t)id >= state.responses.size() >> 16)
+				return "undefined response";
+			state.response[i] = id;
+			state.updated = 1;
+		} break;
+		case 'g':   //Fade the grand master
+		case 'm': { //Fade a submaster
+			size_t k = 0, d;
+			if (op == 'm' && (!args.num(k, 1) || k == 0 ||
+					k >= State::Masters::kMasters))
+				return "invalid submaster";
+			if (!args.num(d, 4))
+				return "invalid master fade";
+
+			int level = args.takeByte();
+			if (level < 0)
+				return "invalid character in master fade";
+			unsigned c;
+			if (!args.curve(c))
+				return "unknown fade curve";
+
+			uint32_t tgt = level * (1 << 16) / 0xFF;
+			state.masters.fade(k, state.now, d * 1000, tgt, (Curve)c);
+		} break;
+		case 'M': { //Put a slot under the grand master and a submaster
+			size_t i;
+			unsigned sub;
+			if (!args.num(i, 2) || !args.num(sub, 1))
+				return "invalid master assignment";
+			if (i >= state.size)
+				return "invalid index";
+			if (sub >= State::Masters::kMasters)
+				return "invalid submaster";
+			state.group[i] = 1 + sub;
+			state.updated = 1;
+		} break;
+		case 'x': { //Install an effect
+			unsigned id, wave, period;
+			if (!args.num(id, 1) || id >= State::Effects::kEffects)
+				return "invalid effect id";
+			if (!args.num(wave, 1) || wave >= kWaves)
+				return "unknown waveform";
+			if (!args.num(period, 4) || period == 0)
+				return "invalid effect period";
+			int depth = args.takeByte();
+			if (depth < 0)
+				return "invalid character in effect depth";
+			int mode = args.takeChar();
+			if (mode != '*' && mode != '+')
+				return "effect mode must be * or +";
+
+			auto& fx = state.effects;
+			fx.remove(id);
+			fx.start[id] = state.now;
+			uint64_t us = period * uint64_t{1000};
+			fx.rate[id]  = (0 - us) / us + 1; //2^64 / us, kept to 64 bits
+			fx.depth[id] = depth * (1 << 16) / 0xFF;
+			fx.wave[id]  = wave;
+			fx.mode[id]  = mode == '*'
+				? State::Effects::scale : State::Effects::offset;
+
+			//Members as <slot>[/<phase in 65536ths of a cycle>]
+			for (size_t i; !args.done(); )
+			{
+				uint32_t ph = 0;
+				if (!args.num(i, 2))
+					return fx.remove(id), "invalid effect member";
+				if (args.binary)
+				{
+					if (!args.num(ph, 2))
+						return fx.remove(id), "invalid effect phase";
+				}
+				else if (args.rest.size() && args.rest.front() == '/')
+				{
+					args.rest.remove_prefix(1);
+					if (!takeNumber(args.rest, ph) || ph > 0xFFFF)
+						return fx.remove(id), "invalid effect phase";
+				}
+				if (i >= state.size)
+					return fx.remove(id), "invalid index";
+				if (!fx.add(id, i, ph << 16))
+					return fx.remove(id), "too many effect members";
+			}
+		} break;
+		case 'X': { //Remove an effect
+			unsigned id;
+			if (!args.num(id, 1) || id >= State::Effects::kEffects)
+				return "invalid effect id";
+			state.effects.remove(id);
+			state.updated = 1;
+		} break;
+		case 'f': { //Frame rate
+			unsigned hz;
+			if (!args.num(hz, 2) || hz == 0 || hz > 1000)
+				return "frame rate must be 1 to 1000 per second";
+			state.period = Clock::duration{1s} / hz;
+		} break;
+		case 'n': { //Universe length, of the first universe unless another's given
+			size_t n, u = 0;
+			if (!args.num(n, 2) || n == 0 || n > kSlots)
+				return "universe length must be 1 to 512 slots";
+			if (!args.done() && !args.num(u, 1))
+				return "invalid universe";
+			if (u >= state.universes)
+				return "no such universe";
+			state.length[u] = n;
+			state.updated = 1;
+		} break;
+		case 'u': { //Take slots from the shared universes
+			size_t i, n;
+			if (!args.num(i, 2) || !args.num(n, 2))
+				return "invalid universe update";
+			if (i + n > state.size)
+				return "invalid index";
+			if (!state.shared)
+				return "no shared universe";
+
+			//Only the universes the slots are in are read
+			byte desired[kSlots];
+			for (size_t end = i + n; i < end; )
+			{
+				size_t u = i / kSlots, stop = std::min(end, (u + 1) * kSlots);
+				state.shared->desired[u].read(desired);
+				for (; i < stop; i++)
+					state.set(i, desired[i % kSlots]);
+			}
+			state.updated = 1;
+		} break;
+		case 't': { //Hold a command until a given time
+			uint64_t at;
+			if (!args.num(at, 8))
+				return "invalid time";
+			if (state.scheduled.size() == State::kMaxScheduled)
+				return "too many scheduled commands";
+
+			int op = args.takeChar();
+			if (op < 0 || op == 't')
+				return "invalid scheduled command";
+			state.scheduled.emplace(at, State::Scheduled{(char)op, args.binary,
+					std::string{args.rest}});
+		} break;
+		case 'P': { //Stage a command
+			int op = args.takeChar();
+			if (op < 0 || op == 't' || op == 'P' || op == 'G' || op == 'D')
+				return "invalid staged command";
+			if (state.staged.size() == State::kMaxScheduled)
+				return "too many staged commands";
+			state.staged.push_back({(char)op, args.binary, std::string{args.rest}});
+		} break;
+		case 'G': { //Apply everything staged, in this frame
+			auto staged = std::move(state.staged);
+			state.staged.clear();
+			std::string errs;
+			for (auto& s : staged)
+			{
+				auto err = doCommand({s.op, s.binary, s.body}, state);
+				if (err.size())
+					errs += (errs.size() ? "\n" : "") + err;
+			}
+			return errs;
+		}
+		case 'D': //Drop everything staged
+			state.staged.clear();
+			break;
+		case 'k': { //Mark the end of a batch, to be acknowledged once it's sent
+			uint32_t id;
+			if (!args.num(id, 4))
+				return "invalid mark";
+			state.marks.push_back({id, args.binary});
+			state.watches.push_back({id, args.binary,
+					std::max(state.faders.latest, state.masters.latest)});
+			state.faders.latest = state.masters.latest = 0;
+			state.updated = 1; //So the answer comes on the next frame
+		} break;
+		case 'Z': { //The parent's side of a panic, behind all it sent before it
+			uint32_t seq;
+			if (!args.num(seq, 4))
+				return "invalid panic";
+			std::vector<bool> dim;
+			state.intensity(dim);
+			for (size_t i = 0; i < state.size; i++)
+				if (dim[i])
+					state.set(i, 0);
+			if (seq == state.panicked)
+				state.frozenOut = 0;
+			for (auto& watch : state.watches) //Nothing's worth waiting on now
+				watch.end = state.now;
+			state.updated = 1;
+		} break;
+		case 'e': { //Echo
+			if (state.terminal == -1)
+				return "no terminal to echo on";
+			auto tty = new termios;
+			tcgetattr(state.terminal, tty);
+			tty->c_lflag ^= ECHO;
+			tcsetattr(state.terminal, TCSANOW, tty);
+			delete tty;
+		} break;
+		case 's': { //Supress dumb error
+			state.supressBadAddr = !state.supressBadAddr;
+		} break;
+		default:
+			return "unknown command";
+		}
+		return "";
+	}
+}
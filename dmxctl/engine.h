@@ -0,0 +1,308 @@
+#ifndef LSC_DMX_ENGINE_H
+#define LSC_DMX_ENGINE_H
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "protocol.h"
+
+
+/* The fader and output loop: it takes commands from a link, renders frames and
+   hands them to its sinks until the link closes.  dmxctl-child runs it as a
+   process of its own over stdin and stdout; DmxCtl can instead run it as a
+   thread of the host over a pair of Rings. */
+namespace lsc::engine
+{
+	// Where the loop's commands come from, and where its acks and events go
+	struct Link
+	{
+		int wake; //Readable whenever there may be commands waiting
+		/* The latest panic asked for, set from outside the command stream so
+		   it needn't wait its turn behind what's queued in it */
+		std::atomic<uint32_t> panic{0};
+		/* The signal that sets it, if one does.  It's let in only while the
+		   loop waits, so one landing just before the wait can't go unseen. */
+		int panicSignal = 0;
+
+		// As read(2): -1 with EAGAIN when there's nothing yet, 0 once closed
+		virtual ssize_t read(char*, size_t) = 0;
+		// Anything that can't be taken right away is dropped
+		virtual void write(const char*, size_t) = 0;
+		virtual ~Link() = default;
+	};
+
+	struct FdLink : Link
+	{
+		int out;
+
+		FdLink(int in, int o) : out{o} { wake = in; }
+
+		ssize_t read(char* p, size_t n) override
+		{
+			ssize_t got = ::read(wake, p, n);
+			if (got == 0 && isatty(wake)) //A raw tty gives 0 for "nothing yet"
+			{
+				errno = EAGAIN;
+				return -1;
+			}
+			return got;
+		}
+		void write(const char* p, size_t n) override
+		{ ::write(out, p, n); }
+	};
+
+	/* Commands come through `in`, with `wake` (an eventfd) rung whenever it
+	   goes from empty to not, and events go back through `out`, with `events`
+	   rung the same way. */
+	struct RingLink : Link
+	{
+		proto::Ring in{1 << 20};
+		proto::Ring out{1 << 16};
+		std::atomic<bool> closed{0}; //Set by the host once it's done sending
+		std::atomic<bool> stopped{0}; //Set once the loop has returned
+
+		int events = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		RingLink() { wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
+		~RingLink() override
+		{
+			if (wake != -1)
+				::close(wake);
+			if (events != -1)
+				::close(events);
+		}
+
+		ssize_t read(char* p, size_t n) override
+		{
+			if (size_t got = in.pop(p, n))
+				return got;
+			//Clear the bell first, so a push after this rings it again
+			uint64_t rung;
+			::read(wake, &rung, sizeof(rung));
+			bool done = closed.load(std::memory_order_acquire); //Before the last look
+			if (size_t got = in.pop(p, n))
+				return got;
+			if (done)
+				return 0;
+			errno = EAGAIN;
+			return -1;
+		}
+		void write(const char* p, size_t n) override
+		{
+			bool wasEmpty;
+			if (out.room() >= n) //Never half an event
+				out.push(p, n, &wasEmpty);
+			else
+				return;
+			if (wasEmpty)
+				eventfd_write(events, 1);
+		}
+
+		// Host side: queues what fits, returning how much
+		size_t send(const char* p, size_t n)
+		{
+			bool wasEmpty;
+			size_t put = in.push(p, n, &wasEmpty);
+			if (wasEmpty)
+				eventfd_write(wake, 1);
+			return put;
+		}
+		void raise(uint32_t seq)
+		{
+			panic.store(seq, std::memory_order_release);
+			eventfd_write(wake, 1);
+		}
+		void close()
+		{
+			closed.store(1, std::memory_order_release);
+			eventfd_write(wake, 1);
+		}
+	};
+
+	constexpr size_t kFrame = 1 + proto::kSlots; //A start code, then the slots
+
+	/* One frame of every universe the loop renders: universe u's start code
+	   and slots from data + u*kFrame, of which size(u) bytes go out. */
+	struct Frames
+	{
+		const unsigned char* data;
+		const uint16_t* lengths; //Slots sent of each, after the start code
+		size_t count;
+
+		const unsigned char* operator[](size_t u) const { return data + u * kFrame; }
+		size_t size(size_t u) const { return 1 + lengths[u]; }
+	};
+
+	/* Where frames go.  Every sink is handed the same frames in turn, and
+	   most send just the one universe they were opened for. */
+	struct Sink
+	{
+		size_t universe = 0;
+
+		// Returns 0, with errno set, if the frame didn't go out
+		virtual bool send(const Frames&, int64_t us) = 0;
+		// For a status line: what it is and what it's done
+		virtual std::string describe() const = 0;
+		virtual ~Sink() = default;
+	};
+
+	// A DMX interface's character device, such as dmx_usb's
+	struct DeviceSink : Sink
+	{
+		int fd;
+		std::string path;
+
+		DeviceSink(int f, std::string p) : fd{f}, path{p} { }
+		~DeviceSink() override { close(fd); }
+
+		bool send(const Frames& f, int64_t) override
+		{ return write(fd, f[universe], f.size(universe)) != -1; }
+		std::string describe() const override
+		{ return path; }
+	};
+
+	// Goes nowhere, but counts, for timing everything up to the wire
+	struct NullSink : Sink
+	{
+		std::atomic<uint64_t> frames{0}, bytes{0};
+
+		bool send(const Frames& f, int64_t) override
+		{
+			frames.fetch_add(1, std::memory_order_relaxed);
+			bytes.fetch_add(f.size(universe), std::memory_order_relaxed);
+			return 1;
+		}
+		std::string describe() const override
+		{
+			return "null: " + std::to_string(frames.load()) + " frames, " +
+				std::to_string(bytes.load()) + " bytes";
+		}
+	};
+
+	/* Frames as records: when the frame went out, in us on the steady clock
+	   (8 bytes), its length (2), then the frame, all little-endian. */
+	constexpr size_t kRecordHeader = 10;
+
+	/* Records to a file or FIFO.  A FIFO nobody's keeping up with loses
+	   whole frames rather than holding the loop up. */
+	struct FileSink : Sink
+	{
+		int fd;
+		std::string path;
+		std::atomic<uint64_t> frames{0}, dropped{0};
+
+		FileSink(int f, std::string p) : fd{f}, path{p} { }
+		~FileSink() override { close(fd); }
+
+		bool send(const Frames&, int64_t us) override;
+		std::string describe() const override
+		{
+			return "file " + path + ": " + std::to_string(frames.load()) + " frames, " +
+				std::to_string(dropped.load()) + " dropped";
+		}
+	};
+
+	/* Records kept in memory for the host to read back, so a test can see
+	   exactly what went out.  Only of use with the engine in the host's own
+	   process. */
+	struct LoopbackSink : Sink
+	{
+		proto::Ring records{1 << 20};
+		std::atomic<uint64_t> frames{0}, dropped{0};
+
+		bool send(const Frames&, int64_t us) override;
+		std::string describe() const override
+		{
+			return "loopback: " + std::to_string(frames.load()) + " frames, " +
+				std::to_string(dropped.load()) + " dropped";
+		}
+
+		/* Host side: takes the oldest frame not yet read into `frame`,
+		   returning its length, or 0 if there's none. */
+		size_t next(unsigned char (&frame)[kFrame], int64_t* us = nullptr);
+	};
+
+	/* DMX over UDP to lighting nodes, as Art-Net 4 ArtDmx or sACN (E1.31)
+	   data packets, one per port: a universe of ours sent as a universe of the
+	   protocol's to some address.  Each packet's header is built once and only
+	   its sequence number and length change; the slots go out straight from
+	   the frame, and every port due in a frame goes in the one sendmmsg,
+	   wherever it's going.  A universe that hasn't changed is only sent again
+	   every kKeepalive, which is all either protocol asks for. */
+	struct UdpSink : Sink
+	{
+		enum class Protocol { artnet, sacn };
+		static constexpr uint16_t kArtNetPort = 6454, kSacnPort = 5568;
+		static constexpr int64_t kKeepalive = 1'000'000; //us
+		static constexpr size_t kMaxHeader = 125; //sACN's; Art-Net's is 18
+
+		Protocol protocol;
+		int fd;
+		std::string name;
+		unsigned char cid[16]; //sACN's id for this source, made up at startup
+		std::atomic<uint64_t> packets{0}, dropped{0};
+
+		struct Port
+		{
+			size_t source;     //Ours
+			uint16_t universe; //On the wire
+			sockaddr_in to;
+			unsigned char header[kMaxHeader];
+			unsigned char last[kFrame]; //As last sent
+			size_t lastLength;
+			int64_t lastSent; //us; 0 for never
+			unsigned char sequence;
+		};
+		std::vector<Port> ports;
+		// Reused every frame: up to three parts per port, and a message each
+		std::vector<iovec> iov;
+		std::vector<mmsghdr> msgs;
+		static const unsigned char zero; //Pads an odd Art-Net length
+
+		UdpSink(Protocol, int fd, std::string name);
+		~UdpSink() override { close(fd); }
+
+		// Sends universe `source` of the frames as `universe`, to `to`
+		void addPort(size_t source, uint16_t universe, const sockaddr_in& to);
+		bool send(const Frames&, int64_t us) override;
+		std::string describe() const override
+		{
+			return name + ": " + std::to_string(packets.load()) + " packets, " +
+				std::to_string(dropped.load()) + " dropped";
+		}
+
+	private:
+		// Lays out a port's packet for the frame as message m
+		void pack(Port&, const unsigned char* frame, size_t n, size_t m);
+	};
+
+	/* Opens the sinks a spec names: for each universe in turn, separated by
+	   semicolons, a comma-separated list of `null`, `file:<path>`, `loopback`,
+	   `artnet:<host>[:<port>][/<universe>]`,
+	   `sacn:[<host>][:<port>][/<universe>]`, or the path of a device.  An
+	   Art-Net or sACN universe left out is the one in the same place as ours,
+	   counting from 0 or 1 respectively.  All the Art-Net outputs share one
+	   socket, as do all the sACN ones.
+	   Returns an error, or empty. */
+	std::string openSinks(const std::string& spec,
+			std::vector<std::unique_ptr<Sink>>& out);
+	// How many universes a spec gives outputs for
+	inline size_t universesIn(const std::string& spec)
+	{ return 1 + std::count(spec.begin(), spec.end(), ';'); }
+
+	/* Runs the loop over `universes` universes until `link` closes, mirroring
+	   output into `shared` if it's given.  Returns nonzero if it had to give
+	   up. */
+	int run(const std::vector<Sink*>& sinks, size_t universes, Link& link,
+			proto::Shared* shared);
+}
+
+
+#endif
@@ -3,20 +3,93 @@
 #include <fcntl.h>
 #include <cassert>
 #include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
 #include <signal.h>
+#include <sys/mman.h>
+#include <poll.h>
 
 // #include <iostream>
 
 
 namespace lsc
 {
+	// Samples one of the child's fade curve shapes as a response curve
+	std::vector<byte> responsePreset(FadeCurve curve)
+	{
+		constexpr int kPoints = 33;
+		std::vector<byte> out;
+		for (int i = 0; i < kPoints; i++)
+		{
+			double p = (double)i / (kPoints - 1);
+			switch (curve)
+			{
+			case FadeCurve::linear: break;
+			case FadeCurve::scurve: p = p * p * (3 - 2*p); break;
+			case FadeCurve::square: p = p * p;             break;
+			case FadeCurve::log:    p = std::log10(1 + 9*p); break;
+			}
+			out.push_back(std::lround(p * 0xFF));
+		}
+		return out;
+	}
+
+
 	DmxCtl::DmxCtl(std::vector<std::string> args)
 	{
-		if (args.size() != 2)
+		if (args.size() < 2)
+			throw std::domain_error(
+					"[DmxCtl::DmxCtl] Expects an output (a device path, or "
+					"null/file:<path>/loopback/artnet:<host>/sacn:<host>, "
+					"comma-separated, with a semicolon between universes), an "
+					"instrument file path, and any options."
+				);
+		universes = engine::universesIn(args[0]);
+		if (universes > proto::kMaxUniverses)
 			throw std::domain_error(
-					"[DmxCtl::DmxCtl] Expects a device path and an instrument file path."
+					"[DmxCtl::DmxCtl] No more than " +
+					std::to_string(proto::kMaxUniverses) + " universes are supported."
 				);
 
+		// Options are given as key=value after the two paths
+		for (size_t a = 2; a < args.size(); a++)
+		{
+			size_t eq = args[a].find('=');
+			std::string key = args[a].substr(0, eq);
+			std::string val = eq == std::string::npos ? "" : args[a].substr(eq + 1);
+			if (key == "rate")
+			{
+				size_t used = 0;
+				try { frameRate = std::stoul(val, &used); } catch (...) { }
+				if (!used || used != val.size() || frameRate < 1 || frameRate > 1000)
+					throw std::domain_error(
+							"[DmxCtl::DmxCtl] rate must be 1 to 1000 frames per second."
+						);
+			}
+			else if (key == "engine")
+			{
+				if (val != "process" && val != "thread")
+					throw std::domain_error(
+							"[DmxCtl::DmxCtl] engine must be process or thread."
+						);
+				if (val == "thread")
+					link = std::make_unique<engine::RingLink>();
+			}
+			else if (key == "protocol")
+			{
+				if (val != "binary" && val != "text")
+					throw std::domain_error(
+							"[DmxCtl::DmxCtl] protocol must be binary or text."
+						);
+				textProtocol = val == "text";
+			}
+			else
+				throw std::domain_error(
+						"[DmxCtl::DmxCtl] Unknown option `" + key + "`."
+					);
+		}
+
 		auto instrFile = yaml::LoadFile(args[1]);
 		if (!instrFile.IsSequence())
 			throw std::domain_error(
@@ -46,11 +119,44 @@ namespace lsc
 			BADKEY_THROW(*i, addr, Scalar);
 			BADKEY_THROW(*i, channels, Sequence);
 
+			// Addresses count from the start of the instrument's universe
+			size_t universe = 0;
+			if ((*i)["universe"])
+			{
+				WRONGTYPE_THROW(*i, universe, Scalar);
+				universe = (*i)["universe"].as<size_t>();
+			}
+			size_t addr = (*i)["addr"].as<size_t>();
+			if (universe >= universes)
+				throw std::domain_error(
+						"[DmxCtl::DmxCtl] " + (*i)["name"].as<std::string>() +
+						" is in universe " + std::to_string(universe) +
+						", but there are outputs for only " +
+						std::to_string(universes) + "."
+					);
+			if (addr + (*i)["channels"].size() > proto::kSlots)
+				throw std::domain_error(
+						"[DmxCtl::DmxCtl] " + (*i)["name"].as<std::string>() +
+						" runs past the end of its universe."
+					);
+
 			instruments.emplace_back(
 					(*i)["name"].as<std::string>(),
-					(*i)["addr"].as<size_t>(),
+					universe * proto::kSlots + addr,
 					std::vector<Channel>{}
 				);
+			if ((*i)["submaster"])
+			{
+				WRONGTYPE_THROW(*i, submaster, Scalar);
+				instruments.back().submaster = (*i)["submaster"].as<std::string>();
+				submasters.try_emplace(
+						instruments.back().submaster, submasters.size() + 1
+					);
+				if (submasters.size() > 63)
+					throw std::domain_error(
+							"[DmxCtl::DmxCtl] No more than 63 submasters are supported."
+						);
+			}
 
 			auto instChannels = (*i)["channels"];
 			for (auto j = instChannels.begin(); j != instChannels.end(); ++j)
@@ -102,6 +208,12 @@ namespace lsc
 								occurances.front()->target, occurances.front()->values,
 								0
 							);
+						instruments.back().channels.back().response =
+							occurances.front()->response;
+						instruments.back().channels.back().fine =
+							occurances.front()->fine;
+						instruments.back().channels.back().holdOnPanic =
+							occurances.front()->holdOnPanic;
 						//instruments.back().channels.back().chanid = instruments.back().channels.size()-1;
 						//instruments.back().channels.back().valindex = idx;
 					}
@@ -115,8 +227,12 @@ namespace lsc
 				{
 					std::string targetStr = (*j)["target"].as<std::string>();
 					if (Channel::targetMapping.count(targetStr))
-						instruments.back().channels.back().target =
-							Channel::targetMapping.at(targetStr);
+					{
+						auto& chan = instruments.back().channels.back();
+						chan.target = Channel::targetMapping.at(targetStr);
+						chan.fine = chan.target == Channel::pan || chan.target == Channel::tilt;
+						chan.holdOnPanic = chan.fine;
+					}
 					else
 						throw std::domain_error(
 								"[DmxCtl::DmxCtl] Unrecognized channel target \"" +
@@ -124,6 +240,56 @@ namespace lsc
 							);
 				}
 
+				if ((*j)["fine"])
+				{
+					WRONGTYPE_THROW(*j, fine, Scalar);
+					instruments.back().channels.back().fine = (*j)["fine"].as<bool>();
+				}
+
+				if ((*j)["panic"])
+				{
+					WRONGTYPE_THROW(*j, panic, Scalar);
+					std::string panic = (*j)["panic"].as<std::string>();
+					if (panic != "hold" && panic != "dark")
+						throw std::domain_error(
+								"[DmxCtl::DmxCtl] " + instruments.back().name + " > " +
+								instruments.back().channels.back().name +
+								" > panic must be hold or dark."
+							);
+					instruments.back().channels.back().holdOnPanic = panic == "hold";
+				}
+
+				if ((*j)["response"])
+				{
+					auto resp = (*j)["response"];
+					auto& chan = instruments.back().channels.back();
+					chan.response.clear();
+					if (resp.IsScalar() &&
+							fadeCurveMapping.count(resp.as<std::string>()))
+						chan.response = responsePreset(
+								fadeCurveMapping.at(resp.as<std::string>())
+							);
+					else if (resp.IsSequence() && resp.size() >= 2)
+					{
+						for (auto k = resp.begin(); k != resp.end(); ++k)
+						{
+							int level = k->as<int>();
+							if (level < 0 || level > 0xFF)
+								throw std::domain_error(
+										"[DmxCtl::DmxCtl] " + instruments.back().name + " > " +
+										chan.name + " > response levels must be in [0, 255]."
+									);
+							chan.response.push_back(level);
+						}
+					}
+					else
+						throw std::domain_error(
+								"[DmxCtl::DmxCtl] " + instruments.back().name + " > " +
+								chan.name + " > response must be a curve name or a list "
+								"of at least two levels."
+							);
+				}
+
 				if ((*j)["values"])
 				{
 					if (!(*j)["values"]["type"]
@@ -197,18 +363,81 @@ namespace lsc
 #undef WRONGTYPE_THROW
 #undef NEXIST_THROW
 
+		sent.assign(universes * proto::kSlots, 0);
+		fading.assign(universes * proto::kSlots, 0);
+
+		if (link)
+		{
+			std::string err = engine::openSinks(args[0], sinks);
+			if (err.size())
+				throw std::runtime_error("[DmxCtl::DmxCtl] " + err + ".");
+			if (link->wake == -1)
+				throw std::runtime_error(
+						"[DmxCtl::DmxCtl] Failed to get an eventfd."
+					);
+			// Needs no memfd, but one's as good as any other memory
+			void* p = mmap(nullptr, sizeof(proto::Shared),
+					PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+			if (p != MAP_FAILED)
+				shared = (proto::Shared*)p;
+
+			toChild.link = link.get();
+			engineThread = std::thread{[this]
+			{
+				std::vector<engine::Sink*> outputs;
+				for (auto& sink : sinks)
+					outputs.push_back(sink.get());
+				engine::run(outputs, universes, *link, shared);
+				link->stopped.store(1, std::memory_order_release);
+			}};
+			sendPatch();
+			return;
+		}
+
+		/* A child that dies should show up as EPIPE on the next write, not
+		   take the whole host down with it; a handler of the host's own is
+		   left alone. */
+		struct sigaction pipeAction;
+		sigaction(SIGPIPE, nullptr, &pipeAction);
+		if (pipeAction.sa_handler == SIG_DFL)
+			signal(SIGPIPE, SIG_IGN);
+
 		int ok = pipe2(tochildpipe, O_NONBLOCK);  //Should be redundant
 		if (ok == -1)
 			throw std::runtime_error(
 					"[DmxCtl::DmxCtl] Failed to get pipe."
 				);
+		toChild.fd = tochild;
+		fcntl(tochild, F_SETPIPE_SZ, 1 << 20); //Fine if it's refused
 		ok = pipe2(toparentpipe, O_NONBLOCK);  //Should be redundant
 		if (ok == -1)
 			throw std::runtime_error(
 					"[DmxCtl::DmxCtl] Failed to get pipe."
 				);
 
+		/* The universe also goes across through shared memory when it can; the
+		   pipe then only has to say which slots to pick up. */
+		int shm = memfd_create("dmxctl-universe", 0);
+		if (shm != -1 && ftruncate(shm, sizeof(proto::Shared)) != -1)
+		{
+			void* p = mmap(nullptr, sizeof(proto::Shared),
+					PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+			if (p != MAP_FAILED)
+				shared = (proto::Shared*)p;
+		}
+		std::string shmArg = std::to_string(shm);
+
+		/* Panics go over as SIGRTMIN, and one raised before the child has its
+		   handler would kill it; the child starts with the signal blocked, and
+		   unblocks it once it's ready. */
+		sigset_t panicSet, oldMask;
+		sigemptyset(&panicSet);
+		sigaddset(&panicSet, SIGRTMIN);
+		pthread_sigmask(SIG_BLOCK, &panicSet, &oldMask);
+
 		chid = fork();
+		if (chid != 0)
+			pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
 		switch (chid)
 		{
 		case -1:
@@ -218,9 +447,16 @@ namespace lsc
 		case 0: //Child
 			close(0); dup(childin);
 			close(1); dup(toparent);
+			for (int fd : {childin, toparent, tochild, parentin})
+				close(fd);
 			//close(2); dup(toparent); //For now, let errors pass through
 		#ifdef COMPILE_TIME_PWD
-			ok = execl(COMPILE_TIME_PWD "/dmxctl-child", "dmxctl-child", args[0].c_str(), 0);
+			if (shared)
+				ok = execl(COMPILE_TIME_PWD "/dmxctl-child", "dmxctl-child",
+						args[0].c_str(), shmArg.c_str(), (char*)0);
+			else
+				ok = execl(COMPILE_TIME_PWD "/dmxctl-child", "dmxctl-child",
+						args[0].c_str(), (char*)0);
 			if (ok == -1)
 			{
 				const char msg[] = "bruh moment\n";
@@ -233,6 +469,13 @@ namespace lsc
 			#error "Macro `COMPILE_TIME_PWD` is not defined, but is required to be the absolute path to the directory of the file.  Recommend use of Makefile with requirement satisfied."
 		#endif
 		}
+		if (shm != -1)
+			close(shm);
+		// The child's ends, so its going away shows as EPIPE and EOF here
+		close(childin);
+		close(toparent);
+
+		sendPatch();
 	}
 
 
@@ -383,8 +626,8 @@ namespace lsc
 			const std::vector<std::string>& args
 			)
 	{
-
-
+		/* A rejected instruction never reaches the child, so it gets no mark
+		   and leaves lastCommand on the last one that did. */
 		std::string errorString = verify(inst, args);
 		if (errorString.size())
 			throw std::domain_error(
@@ -393,6 +636,15 @@ namespace lsc
 
 		// All error-checking has been exported.
 
+		/* Fades made by one instruction go out together once it's done.  If it
+		   throws partway, what it gathered goes with the next command. */
+		batchingFades = 1;
+		struct StopBatching
+		{
+			bool& batching;
+			~StopBatching() { batching = 0; }
+		} stopBatching{batchingFades};
+
 
 		if (inst == "loadAndFade")
 		{
@@ -412,15 +664,57 @@ namespace lsc
 						std::chrono::minutes{(std::chrono::minutes::rep)num}
 					);
 
+			FadeCurve curve = FadeCurve::linear;
+			if (args.size() == 3)
+				curve = fadeCurveMapping.at(args[2]);
+
 			loadScene(args[0]);
 			setValues(Channel::master, 0.0f);
 			writeOut();
 			for (auto& inst : instruments)
-			for (auto& chan : inst[Channel::master])
-				fadeChannel(inst.addr + chan->chanid, dur.count(), 0xFF);
-
-			return;
+				fadeValue(inst, inst[Channel::master], dur.count(), 1.0f, curve);
 		} //loadAndFade
+		else if (inst == "xfade")
+		{
+			std::istringstream strm{args[1]};
+			float num;
+			std::string unit;
+			strm >> num >> unit;
+			std::chrono::milliseconds dur;
+			if (unit == "s")
+				dur = std::chrono::duration_cast<std::chrono::milliseconds>(
+						std::chrono::duration<float>{num}
+					);
+			else if (unit == "ms")
+				dur = std::chrono::milliseconds{(std::chrono::milliseconds::rep)num};
+			else if (unit == "m")
+				dur = std::chrono::duration_cast<std::chrono::milliseconds>(
+						std::chrono::duration<float, std::ratio<60>>{num}
+					);
+
+			// Then a curve, a point for discrete channels to snap at, or both
+			FadeCurve curve = FadeCurve::linear;
+			float snap = 0.5f;
+			for (size_t a = 2; a < args.size(); a++)
+			{
+				if (fadeCurveMapping.count(args[a]))
+					curve = fadeCurveMapping.at(args[a]);
+				else
+					snap = std::stof(args[a]);
+			}
+
+			loadScene(args[0]);
+			std::vector<byte> slots;
+			getSlots(slots);
+			send(message('C')
+					.num(dur.count(), 4)
+					.num((int)curve, 1)
+					.num(std::lround(snap * 0xFF), 1)
+					.hex(slots.data(), slots.size())
+					.str());
+			sent = slots;
+			std::fill(fading.begin(), fading.end(), 1);
+		} //xfade
 		else if (inst == "fadeTo")
 		{
 			float fade;
@@ -445,10 +739,12 @@ namespace lsc
 						std::chrono::minutes{(std::chrono::minutes::rep)num}
 					);
 
+			FadeCurve curve = FadeCurve::linear;
+			if (args.size() == 3)
+				curve = fadeCurveMapping.at(args[2]);
+
 			for (auto& inst : instruments)
-			for (auto& chan : inst[Channel::master])
-				fadeChannel(inst.addr + chan->chanid, dur.count(), fade * 0xFF);
-			/* ^^^ not great ^^^ */
+				fadeValue(inst, inst[Channel::master], dur.count(), fade, curve);
 		} //fadeTo
 		else if (inst == "dark")
 		{
@@ -498,11 +794,143 @@ namespace lsc
 
 			//std::clog << "Fading instrument " << args[0] << " to " <<
 			//	fade << " over " << dur.count() << "ms\n";
+			FadeCurve curve = FadeCurve::linear;
+			if (args.size() == 4)
+				curve = fadeCurveMapping.at(args[3]);
+
 			for (auto lp : (*this)[args[0]])
-			for (auto chan : (*lp)[Channel::master])
-				fadeChannel(lp->addr + chan->chanid, dur.count(), fade * 0xFF);
-			/* ^^^ Not great ^^^ */
+				fadeValue(*lp, (*lp)[Channel::master], dur.count(), fade, curve);
 		} //fadeInstTo
+		else if (inst == "fadeParamTo")
+		{
+			float fade;
+			float num;
+			std::string unit;
+			std::istringstream strm{args[2]};
+			strm >> fade;
+
+			strm.clear();
+			strm.str(args[3]);
+			strm >> num >> unit;
+
+			std::chrono::milliseconds dur;
+			if (unit == "s")
+				dur = std::chrono::duration_cast<std::chrono::milliseconds>(
+						std::chrono::seconds{(std::chrono::seconds::rep)num}
+					);
+			else if (unit == "ms")
+				dur = std::chrono::milliseconds{(std::chrono::milliseconds::rep)num};
+			else if (unit == "m")
+				dur = std::chrono::duration_cast<std::chrono::milliseconds>(
+						std::chrono::minutes{(std::chrono::minutes::rep)num}
+					);
+
+			for (auto lp : (*this)[args[0]])
+			{
+				if (Channel::targetMapping.count(args[1]))
+					fadeValue(*lp, (*lp)[Channel::targetMapping.at(args[1])],
+							dur.count(), fade);
+				else
+					fadeValue(*lp, (*lp)[args[1]], dur.count(), fade);
+			}
+		} //fadeParamTo
+		else if (inst == "masterTo" || inst == "subTo")
+		{
+			bool sub = inst == "subTo";
+			float fade;
+			float num;
+			std::string unit;
+			std::istringstream strm{args[sub]};
+			strm >> fade;
+
+			strm.clear();
+			strm.str(args[sub + 1]);
+			strm >> num >> unit;
+
+			std::chrono::milliseconds dur;
+			if (unit == "s")
+				dur = std::chrono::duration_cast<std::chrono::milliseconds>(
+						std::chrono::seconds{(std::chrono::seconds::rep)num}
+					);
+			else if (unit == "ms")
+				dur = std::chrono::milliseconds{(std::chrono::milliseconds::rep)num};
+			else if (unit == "m")
+				dur = std::chrono::duration_cast<std::chrono::milliseconds>(
+						std::chrono::minutes{(std::chrono::minutes::rep)num}
+					);
+
+			FadeCurve curve = FadeCurve::linear;
+			if (args.size() == sub + 3u)
+				curve = fadeCurveMapping.at(args[sub + 2]);
+
+			fadeMaster(sub ? submasters.at(args[0]) : 0, dur.count(), fade, curve);
+		} //masterTo, subTo
+		else if (inst == "effect")
+		{
+			float num;
+			std::string unit;
+			std::istringstream strm{args[4]};
+			strm >> num >> unit;
+
+			std::chrono::milliseconds period;
+			if (unit == "s")
+				period = std::chrono::duration_cast<std::chrono::milliseconds>(
+						std::chrono::duration<float>{num}
+					);
+			else if (unit == "ms")
+				period = std::chrono::milliseconds{(std::chrono::milliseconds::rep)num};
+
+			float depth, spread = 0;
+			strm.clear();
+			strm.str(args[5]);
+			strm >> depth;
+			if (args.size() == 7)
+			{
+				strm.clear();
+				strm.str(args[6]);
+				strm >> spread;
+			}
+
+			auto [it, added] = effects.try_emplace(args[0], effects.size());
+			byte b = depth * 0xFF;
+			auto msg = message('x');
+			msg.num(it->second, 1)
+				.num((int)waveformMapping.at(args[3]), 1)
+				.num(period.count(), 4)
+				.hex(b);
+
+			/* Intensity is pulled down from where it is; anything else swings
+			   either side of its level.  Multi-byte channels are moved through
+			   their coarse byte. */
+			bool scale = args[2] == "master";
+			msg.flag(scale ? "*" : "+", scale ? '*' : '+', 1);
+			auto insts = (*this)[args[1]];
+			for (size_t k = 0; k < insts.size(); k++)
+			{
+				auto chans = Channel::targetMapping.count(args[2])
+					? (*insts[k])[Channel::targetMapping.at(args[2])]
+					: (*insts[k])[args[2]];
+				const Channel* coarse = chans.front();
+				for (auto chan : chans)
+					if (chan->valindex > coarse->valindex)
+						coarse = chan;
+
+				size_t phase = std::ldexp(spread * k / insts.size(), 16);
+				msg.member(insts[k]->addr + coarse->chanid,
+						phase > 0xFFFF ? 0xFFFF : phase);
+			}
+			auto& out = msg.str();
+			send(out);
+		} //effect
+		else if (inst == "stopEffect")
+		{
+			std::string out = message('X').num(effects.at(args[0]), 1).str();
+			send(out);
+		} //stopEffect
+
+		batchingFades = 0;
+		flushFades();
+		lastBatch = mark();
 	} //execute
 
 
@@ -519,8 +947,8 @@ namespace lsc
 					)
 				return "Expects a file and a duration.";
 			*/
-			if (args.size() != 2)
-				return "Expects a file and a duration.";
+			if (args.size() != 2 && args.size() != 3)
+				return "Expects a file, a duration, and optionally a curve.";
 			if (!fs::is_regular_file(fs::path(args[0])))
 				return "Expected `" + args[0] + "` to be a filepath.";
 
@@ -537,11 +965,47 @@ namespace lsc
 					unit != "ms" &&
 					unit != "m")
 				return "Unrecognized unit \"" + unit + "\".";
+			if (args.size() == 3 && !fadeCurveMapping.count(args[2]))
+				return "Unrecognized fade curve \"" + args[2] + "\".";
 		} //loadAndFade
+		else if (inst == "xfade")
+		{
+			if (args.size() < 2 || args.size() > 4)
+				return "Expects a file, a duration, and optionally a curve and a snap "
+					"point.";
+			if (!fs::is_regular_file(fs::path(args[0])))
+				return "Expected `" + args[0] + "` to be a filepath.";
+
+			std::string errorString = checkScene(args[0]);
+			if (errorString.size())
+				return "Invalid scene file: " + errorString;
+			std::istringstream strm{args[1]};
+			float num = -1;
+			std::string unit;
+			strm >> num >> unit;
+			if (num < 0)
+				return "Negative duration not supported.";
+			if (unit != "s" &&
+					unit != "ms" &&
+					unit != "m")
+				return "Unrecognized unit \"" + unit + "\".";
+			for (size_t a = 2; a < args.size(); a++)
+			{
+				if (fadeCurveMapping.count(args[a]))
+					continue;
+				float snap = -1;
+				strm.clear();
+				strm.str(args[a]);
+				strm >> snap;
+				if (!strm || snap < 0 || snap > 1)
+					return "Expected a fade curve or a snap point in [0, 1], not \"" +
+						args[a] + "\".";
+			}
+		} //xfade
 		else if (inst == "fadeTo")
 		{
-			if (args.size() != 2)
-				return "Expects a fade value and a duration.";
+			if (args.size() != 2 && args.size() != 3)
+				return "Expects a fade value, a duration, and optionally a curve.";
 			float fade;
 			float dur;
 			std::string unit;
@@ -558,6 +1022,8 @@ namespace lsc
 					unit != "ms" &&
 					unit != "m")
 				return "Unrecognized unit \"" + unit + "\".";
+			if (args.size() == 3 && !fadeCurveMapping.count(args[2]))
+				return "Unrecognized fade curve \"" + args[2] + "\".";
 		} //fadeTo
 		else if (inst == "dark")
 		{
@@ -599,8 +1065,8 @@ namespace lsc
 		}
 		else if (inst == "fadeInstTo")
 		{
-			if (args.size() != 3)
-				return "Expects an instrument, fade value, and duration.";
+			if (args.size() != 3 && args.size() != 4)
+				return "Expects an instrument, fade value, duration, and optionally a curve.";
 			float fade;
 			float dur;
 			std::string unit;
@@ -617,7 +1083,121 @@ namespace lsc
 					unit != "ms" &&
 					unit != "m")
 				return "Unrecognized unit \"" + unit + "\".";
+			if (args.size() == 4 && !fadeCurveMapping.count(args[3]))
+				return "Unrecognized fade curve \"" + args[3] + "\".";
 		} //fadeTo
+		else if (inst == "fadeParamTo")
+		{
+			if (args.size() != 4)
+				return "Expects an instrument, channel, value, and duration.";
+			auto insts = (*this)[args[0]];
+			if (!insts.size())
+				return "`" + args[0] + "` does not name a known instrument.";
+			for (auto lp : insts)
+			{
+				if (Channel::targetMapping.count(args[1])
+						? !(*lp)[Channel::targetMapping.at(args[1])].size()
+						: !(*lp)[args[1]].size())
+					return "`" + lp->name + "` does not have a channel `" + args[1] + "`";
+			}
+			float fade;
+			float dur;
+			std::string unit;
+			std::istringstream strm{args[2]};
+			strm >> fade;
+			if (fade < 0 || fade > 1)
+				return "Value must be in [0, 1].";
+			strm.clear();
+			strm.str(args[3]);
+			strm >> dur >> unit;
+			if (dur < 0)
+				return "Negative duration not supported.";
+			if (unit != "s" &&
+					unit != "ms" &&
+					unit != "m")
+				return "Unrecognized unit \"" + unit + "\".";
+		} //fadeParamTo
+		else if (inst == "masterTo" || inst == "subTo")
+		{
+			bool sub = inst == "subTo";
+			if (args.size() != sub + 2u && args.size() != sub + 3u)
+				return sub
+					? "Expects a submaster, fade value, duration, and optionally a curve."
+					: "Expects a fade value, a duration, and optionally a curve.";
+			if (sub && !submasters.count(args[0]))
+				return "`" + args[0] + "` does not name a known submaster.";
+			float fade;
+			float dur;
+			std::string unit;
+			std::istringstream strm{args[sub]};
+			strm >> fade;
+			if (fade < 0 || fade > 1)
+				return "Fade value must be in [0, 1].";
+			strm.clear();
+			strm.str(args[sub + 1]);
+			strm >> dur >> unit;
+			if (dur < 0)
+				return "Negative duration not supported.";
+			if (unit != "s" &&
+					unit != "ms" &&
+					unit != "m")
+				return "Unrecognized unit \"" + unit + "\".";
+			if (args.size() == sub + 3u && !fadeCurveMapping.count(args[sub + 2]))
+				return "Unrecognized fade curve \"" + args[sub + 2] + "\".";
+		} //masterTo, subTo
+		else if (inst == "effect")
+		{
+			if (args.size() != 6 && args.size() != 7)
+				return "Expects a name, instrument, channel, waveform, period, depth, "
+					"and optionally a phase spread.";
+			if (!effects.count(args[0]) && effects.size() == 256)
+				return "Too many effects.";
+			auto insts = (*this)[args[1]];
+			if (!insts.size())
+				return "`" + args[1] + "` does not name a known instrument.";
+			for (auto lp : insts)
+			{
+				if (Channel::targetMapping.count(args[2])
+						? !(*lp)[Channel::targetMapping.at(args[2])].size()
+						: !(*lp)[args[2]].size())
+					return "`" + lp->name + "` does not have a channel `" + args[2] + "`";
+			}
+			if (!waveformMapping.count(args[3]))
+				return "Unrecognized waveform \"" + args[3] + "\".";
+			float num;
+			std::string unit;
+			std::istringstream strm{args[4]};
+			strm >> num >> unit;
+			if (num <= 0)
+				return "Period must be positive.";
+			if (unit != "s" &&
+					unit != "ms")
+				return "Unrecognized unit \"" + unit + "\".";
+			if (unit == "s" ? num < 0.001 : num < 1)
+				return "Period must be at least 1ms.";
+			float depth;
+			strm.clear();
+			strm.str(args[5]);
+			strm >> depth;
+			if (!strm || depth < 0 || depth > 1)
+				return "Depth must be in [0, 1].";
+			if (args.size() == 7)
+			{
+				float spread;
+				strm.clear();
+				strm.str(args[6]);
+				strm >> spread;
+				if (!strm || spread < 0 || spread > 1)
+					return "Phase spread must be in [0, 1].";
+			}
+		} //effect
+		else if (inst == "stopEffect")
+		{
+			if (args.size() != 1)
+				return "Expects an effect name.";
+			if (!effects.count(args[0]))
+				return "`" + args[0] + "` does not name a running effect.";
+		} //stopEffect
 		else
 			return "Unknown command.";
 
@@ -625,7 +1205,24 @@ namespace lsc
 	}
 	std::string DmxCtl::state() const
 	{
-		return "good"; //TODO: bruh
+		std::string out = toChild.backlog() ? "backlogged" : "good";
+		out += "; queue " + std::to_string(toChild.backlog()) + " bytes, peak " +
+			std::to_string(toChild.peak()) + " bytes";
+		if (toChild.waits())
+			out += ", full " + std::to_string(toChild.waits()) + " times";
+		if (toChild.lost())
+			out += ", " + std::to_string(toChild.lost()) + " bytes lost";
+		for (auto& sink : sinks)
+			out += "; " + sink->describe();
+		if (panics && panicLatency < Clock::duration::zero())
+			out += "; panic not yet on the wire";
+		else if (panics)
+			out += "; panic took " + std::to_string(
+					std::chrono::duration_cast<std::chrono::microseconds>(panicLatency).count()
+				) + " us, worst " + std::to_string(
+					std::chrono::duration_cast<std::chrono::microseconds>(worstPanic).count()
+				) + " us";
+		return out;
 	}
 
 	DmxCtl::operator bool() const
@@ -633,30 +1230,296 @@ namespace lsc
 		return 1;
 	}
 
-	DmxCtl::~DmxCtl()
+	void DmxCtl::poll()
+	{
+		toChild.flush();
+		readChild();
+	}
+
+	int DmxCtl::pollFd() const
+	{
+		//A child that's gone would have its pipe readable forever
+		return link ? link->events : childGone ? -1 : parentin;
+	}
+
+	uint32_t DmxCtl::mark()
 	{
-		kill(chid, SIGTERM);
+		uint32_t id = nextBatch++;
+		send(message('k').num(id, 4).str());
+		unacked[id] = Clock::now();
+		if (staging)
+			stagedBatches.push_back(id);
+		return id;
 	}
 
+	bool DmxCtl::prepare(const std::string& inst, const std::vector<std::string>& args)
+	{
+		if (!staging)
+		{
+			beforeStaging.values.clear();
+			for (auto& in : instruments)
+				for (auto& chan : in.channels)
+					beforeStaging.values.push_back(chan.value);
+			beforeStaging.sent = sent;
+			beforeStaging.fading = fading;
+			beforeStaging.effects = effects;
+			beforeStaging.lastBatch = lastBatch;
+			stagedBatches.clear();
+			staging = 1;
+		}
 
+		// Nothing's done before an instruction checks out, so a bad one is just
+		// left to fail when it's executed for real
+		if (verify(inst, args).size())
+			return 0;
+		execute(inst, args);
+		return 1;
+	}
+
+	void DmxCtl::commit()
+	{
+		if (!staging)
+			return;
+		staging = 0;
+		send(message('G').str());
+		auto now = Clock::now();
+		for (auto id : stagedBatches)
+			if (unacked.count(id))
+				unacked[id] = now;
+		stagedBatches.clear();
+	}
 
+	void DmxCtl::discard()
+	{
+		if (!staging)
+			return;
+		staging = 0;
+		send(message('D').str());
+
+		auto v = beforeStaging.values.begin();
+		for (auto& in : instruments)
+			for (auto& chan : in.channels)
+				chan.value = *v++;
+		sent = beforeStaging.sent;
+		fading = beforeStaging.fading;
+		effects = beforeStaging.effects;
+		lastBatch = beforeStaging.lastBatch;
+		for (auto id : stagedBatches)
+		{
+			unacked.erase(id);
+			retire(id); //It's never going to run, so nothing's left of it to wait on
+		}
+		stagedBatches.clear();
+	}
 
-	void DmxCtl::getSlots(byte (&slots)[512]) const
+	void DmxCtl::panic()
 	{
-		auto ini = instruments.begin();
-		for (size_t chi = 0; chi < 512; chi++)
+		discard();
+		panicAt = Clock::now();
+		panicLatency = Clock::duration{-1}; //Till the child says
+		++panics;
+		if (link)
+			link->raise(panics);
+		else
 		{
-			if (ini != instruments.end() && ini->addr <= chi)
+			sigval v;
+			v.sival_int = panics;
+			sigqueue(chid, SIGRTMIN, v);
+		}
+
+		/* The child holds the output dark until it reaches this, after all that
+		   was queued ahead of the panic; it and the model agree from there. */
+		effects.clear();
+		for (auto& inst : instruments)
+			for (auto& chan : inst.channels)
+				if (!chan.holdOnPanic)
+					chan.value = 0;
+		send(proto::Message{!textProtocol, 'Z'}.num(panics, 4).str());
+		auto at = applyAt;
+		applyAt = {};
+		writeOut();
+		applyAt = at;
+	}
+
+	engine::LoopbackSink* DmxCtl::loopback()
+	{
+		for (auto& sink : sinks)
+			if (auto loop = dynamic_cast<engine::LoopbackSink*>(sink.get()))
+				return loop;
+		return nullptr;
+	}
+
+	const DmxCtl::Ack* DmxCtl::acked(uint32_t batch)
+	{
+		readChild();
+		for (auto a = acks.rbegin(); a != acks.rend(); ++a)
+			if (a->batch == batch)
+				return &*a;
+		return nullptr;
+	}
+
+	const DmxCtl::Ack* DmxCtl::lastAck()
+	{
+		readChild();
+		return acks.size() ? &acks.back() : nullptr;
+	}
+
+	void DmxCtl::executeAt(Clock::time_point when)
+	{
+		applyAt = when;
+	}
+
+	size_t DmxCtl::lastCommand() const
+	{
+		return lastBatch;
+	}
+
+	bool DmxCtl::completed(size_t batch)
+	{
+		readChild();
+		return batch < doneBelow || doneAbove.count(batch);
+	}
+
+	void DmxCtl::retire(uint32_t id)
+	{
+		constexpr size_t kMaxAhead = 4096;
+
+		if (id < doneBelow)
+			return;
+		doneAbove.insert(id);
+		/* A batch still not done when this many after it are has had its word
+		   lost on the way -- a child that fell too far behind to say it, say --
+		   and is given up on rather than holding everything up forever. */
+		if (doneAbove.size() > kMaxAhead)
+			doneBelow = *doneAbove.begin();
+		while (doneAbove.count(doneBelow))
+			doneAbove.erase(doneBelow++);
+	}
+
+	void DmxCtl::readChild()
+	{
+		constexpr size_t kKept = 256;
+
+		char buf[4096];
+		if (link)
+		{
+			//Clear the bell first, so an event after this rings it again
+			uint64_t rung;
+			read(link->events, &rung, sizeof(rung));
+			for (size_t n; (n = link->out.pop(buf, sizeof(buf))) > 0; )
+				fromChild.append(buf, n);
+		}
+		else
+		{
+			ssize_t n;
+			while ((n = read(parentin, buf, sizeof(buf))) > 0)
+				fromChild.append(buf, n);
+			if (n == 0)
+				childGone = 1;
+		}
+
+		/* Acks come as `a` commands, completions as `d` ones and panics as `z`
+		   ones, all in whichever protocol the child was last spoken to in. */
+		for (;;)
+		{
+			uint64_t id, frame, us;
+			size_t used;
+			char op = 0;
+			if (fromChild.size() && (byte)fromChild[0] == proto::kMagic)
 			{
-				if (chi < ini->addr + ini->channels.size())
-					slots[chi] = ini->channels[chi - ini->addr].value;
-				else
-					++ini;
+				if (fromChild.size() < proto::kHeader)
+					break;
+				auto head = (const byte*)fromChild.data();
+				size_t len = proto::getLE(head + 3, 2);
+				used = proto::kHeader + len;
+				if (fromChild.size() < used)
+					break;
+				op = head[2];
+				if ((op != 'a' && op != 'd' && op != 'z') || len != 16)
+				{
+					fromChild.erase(0, used);
+					continue;
+				}
+				id    = proto::getLE(head + proto::kHeader, 4);
+				frame = proto::getLE(head + proto::kHeader + 4, 4);
+				us    = proto::getLE(head + proto::kHeader + 8, 8);
 			}
 			else
-				slots[chi] = 0;
+			{
+				size_t nl = fromChild.find('\n');
+				if (nl == std::string::npos)
+					break;
+				used = nl + 1;
+				std::istringstream line{fromChild.substr(0, nl)};
+				if (!(line >> op >> id >> frame >> us) ||
+						(op != 'a' && op != 'd' && op != 'z'))
+				{
+					fromChild.erase(0, used);
+					continue;
+				}
+			}
+			fromChild.erase(0, used);
+
+			if (op == 'z')
+			{
+				if (id != panics)
+					continue;
+				panicLatency = Clock::time_point{std::chrono::microseconds{us}} - panicAt;
+				worstPanic = std::max(worstPanic, panicLatency);
+				continue;
+			}
+			if (op == 'd')
+			{
+				retire(id);
+				continue;
+			}
+
+			auto sent = unacked.find(id);
+			if (sent == unacked.end())
+				continue;
+			acks.push_back({
+					(uint32_t)id, (uint32_t)frame, sent->second,
+					Clock::time_point{std::chrono::microseconds{us}}
+				});
+			unacked.erase(unacked.begin(), ++sent); //Earlier ones can't come now
+			if (acks.size() > kKept)
+				acks.pop_front();
 		}
 	}
+
+	DmxCtl::~DmxCtl()
+	{
+		toChild.drain(200);
+		if (link)
+		{
+			link->close();
+			engineThread.join();
+		}
+		else
+			kill(chid, SIGTERM);
+		if (shared)
+			munmap(shared, sizeof(proto::Shared));
+	}
+
+
+
+
+	void DmxCtl::getSlots(std::vector<byte>& slots) const
+	{
+		slots.assign(universes * proto::kSlots, 0);
+		for (auto& inst : instruments)
+			for (auto& chan : inst.channels)
+				slots[inst.addr + chan.chanid] = chan.value;
+	}
+	bool DmxCtl::getOutput(std::vector<byte>& slots) const
+	{
+		if (!shared)
+			return 0;
+		slots.resize(universes * proto::kSlots);
+		for (size_t u = 0; u < universes; u++)
+			shared->output[u].read(&slots[u * proto::kSlots]);
+		return 1;
+	}
 	bool DmxCtl::setValues(Channel::TargetType targ, float f)
 	{
 		using severalBytes = unsigned long long int;
@@ -760,50 +1623,419 @@ namespace lsc
 	}
 
 
-	void DmxCtl::setChannel(size_t idx, byte b)
+	// The curve as a fade's text flag; binary packs it with the others
+	static std::string curveFlag(FadeCurve curve)
 	{
-		constexpr char hexits[] = "0123456789ABCDEF";
+		return curve == FadeCurve::linear ? "" : "c" + std::to_string((int)curve);
+	}
 
+	void DmxCtl::setChannel(size_t idx, byte b)
+	{
 		(*this)[idx].value = b;
-		std::string msg = "@";
-		msg += std::to_string(idx);
-		msg += ' ';
-		msg += hexits[b & 15];
-		msg += hexits[b >> 4];
-		msg += '\n';
-		write(tochild, msg.c_str(), msg.size());
+		sent[idx] = b;
+		fading[idx] = 0;
+		std::string msg;
+		if (viaShared())
+		{
+			auto& desired = shared->desired[idx / proto::kSlots];
+			desired.begin()[idx % proto::kSlots] = b;
+			desired.publish();
+			msg = message('u').num(idx, 2).num(1, 2).str();
+		}
+		else
+			msg = message('@').num(idx, 2).hex(b).str();
+		send(msg);
 	}
-	void DmxCtl::fadeChannel(size_t idx, size_t mills, byte b)
+	void DmxCtl::fadeChannel(size_t idx, size_t mills, byte b, FadeCurve curve)
 	{
-		constexpr char hexits[] = "0123456789ABCDEF";
-
 		(*this)[idx].value = b;
-		std::string msg = ">";
-		msg += std::to_string(idx);
-		msg += ' ';
-		msg += std::to_string(mills);
-		msg += ' ';
-		msg += hexits[b & 15];
-		msg += hexits[b >> 4];
-		msg += '\n';
+		fading[idx] = 1;
+		if (batchingFades)
+		{
+			fadeBatch(mills, curve).target(idx, &b, 1, 0);
+			return;
+		}
+		std::string msg = message('>')
+			.num(idx, 2).num(mills, 4).hex(b)
+			.flag(curveFlag(curve), (int)curve << 4, 1)
+			.str();
 		//std::clog << '\n' << msg;
-		write(tochild, msg.c_str(), msg.size());
+		send(msg);
+	}
+
+	/* Whether a value's channels fill adjacent slots in order of significance,
+	   one way or the other, which the child needs to treat them as one value.
+	   Gives the lowest channel and which way round they go. */
+	static bool contiguous(
+			const std::vector<Channel*>& chans, size_t& first, bool& msbFirst)
+	{
+		size_t w = chans.size();
+		first = chans.front()->chanid;
+		for (auto chan : chans)
+			if (chan->chanid < first)
+				first = chan->chanid;
+		bool lsbFirst = 1;
+		msbFirst = 1;
+		for (auto chan : chans)
+		{
+			msbFirst &= chan->chanid - first == w-1 - chan->valindex;
+			lsbFirst &= chan->chanid - first == chan->valindex;
+		}
+		return msbFirst || lsbFirst;
+	}
+
+	// Whether a split value is one number, not separate components
+	static bool coarseFine(const std::vector<Channel*>& chans)
+	{
+		return std::all_of(chans.begin(), chans.end(),
+				[](const Channel* chan) { return chan->fine; });
+	}
+
+	void DmxCtl::fadeValue(
+			Instrument& inst, const std::vector<Channel*>& chans, size_t mills,
+			float f, FadeCurve curve)
+	{
+		using severalBytes = unsigned long long int;
+
+		if (!chans.size())
+			return;
+		assert(chans.size() < sizeof(severalBytes));
+		severalBytes bytes = (severalBytes{1} << 8*chans.size()) - 1;
+		bytes *= f;
+
+		size_t w = chans.size();
+		size_t first;
+		bool msbFirst;
+		if (w == 1 || w > 3 || !coarseFine(chans) || !contiguous(chans, first, msbFirst))
+		{
+			for (auto chan : chans)
+				fadeChannel(inst.addr + chan->chanid, mills, bytes >> 8*chan->valindex,
+						curve);
+			return;
+		}
+
+		for (auto chan : chans)
+		{
+			chan->value = bytes >> 8*chan->valindex;
+			fading[inst.addr + chan->chanid] = 1;
+		}
+		byte target[3];
+		for (size_t off = 0; off < w; off++)
+			target[off] = bytes >> 8*(msbFirst ? w-1 - off : off);
+
+		if (batchingFades)
+		{
+			fadeBatch(mills, curve).target(inst.addr + first, target, w, !msbFirst);
+			return;
+		}
+		std::string flags = msbFirst ? "" : "l";
+		if (curve != FadeCurve::linear)
+			flags += (flags.size() ? " " : "") + curveFlag(curve);
+		std::string msg = message('>')
+			.num(inst.addr + first, 2).num(mills, 4).hex(target, w)
+			.flag(flags, (!msbFirst) | ((int)curve << 4), 1)
+			.str();
+		send(msg);
+	}
+
+	proto::Message& DmxCtl::fadeBatch(size_t mills, FadeCurve curve)
+	{
+		constexpr size_t kMaxTarget = 40; //Room for one more, in either form
+
+		//The latest batch for these, unless it's as big as a command gets
+		for (auto batch = pendingFades.rbegin(); batch != pendingFades.rend(); ++batch)
+			if (batch->mills == mills && batch->curve == curve)
+			{
+				if (batch->msg.fits(kMaxTarget))
+					return batch->msg;
+				break;
+			}
+		pendingFades.push_back({mills, curve, message('F')});
+		return pendingFades.back().msg.num(mills, 4).num((int)curve, 1);
+	}
+
+	void DmxCtl::flushFades()
+	{
+		std::string msg;
+		for (auto& batch : pendingFades)
+			msg += batch.msg.str();
+		pendingFades.clear();
+		if (msg.size())
+			toChild.push(msg);
+	}
+
+	void DmxCtl::send(const std::string& msg)
+	{
+		flushFades();
+		toChild.push(msg);
+	}
+
+
+
+	void SendQueue::push(const char* data, size_t n)
+	{
+		if (!used && (fd != -1 || link))
+		{
+			//Nothing queued ahead of it, so it can go straight out
+			ssize_t ok;
+			do
+				ok = put(data, n);
+			while (ok == -1 && errno == EINTR);
+			if (ok > 0)
+			{
+				data += ok;
+				n -= ok;
+			}
+			else if (ok == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				discarded += n; //Nobody left to read it
+				return;
+			}
+		}
+
+		bool stalled = 0;
+		auto givingUp = Clock::now() + std::chrono::milliseconds{kMaxStall};
+		while (n)
+		{
+			if (used == ring.size())
+			{
+				//The child has fallen this far behind, so wait for it
+				stalled = 1;
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+						givingUp - Clock::now()
+					).count();
+				if (left <= 0) //It's stuck, so this and all that's queued is lost
+				{
+					discarded += used + n;
+					head = used = 0;
+					break;
+				}
+				await(left);
+				size_t before = used;
+				flush();
+				if (used < before)
+					givingUp = Clock::now() + std::chrono::milliseconds{kMaxStall};
+				continue;
+			}
+
+			size_t tail = (head + used) % ring.size();
+			size_t run = std::min(n, std::min(ring.size() - used, ring.size() - tail));
+			std::memcpy(ring.data() + tail, data, run);
+			used += run;
+			data += run;
+			n -= run;
+		}
+		stalls += stalled;
+		if (used > highWater)
+			highWater = used;
+		flush();
+	}
+
+	bool SendQueue::flush()
+	{
+		while (used)
+		{
+			size_t run = std::min(used, ring.size() - head);
+			ssize_t ok = put(ring.data() + head, run);
+			if (ok == -1)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+				{
+					discarded += used; //Nobody left to read it
+					head = used = 0;
+				}
+				break;
+			}
+			head = (head + ok) % ring.size();
+			used -= ok;
+		}
+		if (!used)
+			head = 0;
+		return used;
+	}
+
+	bool SendQueue::drain(int ms)
+	{
+		auto until = Clock::now() + std::chrono::milliseconds{ms};
+		while (flush())
+		{
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+					until - Clock::now()
+				).count();
+			if (left <= 0)
+				return 0;
+			await(left);
+		}
+		return 1;
+	}
+
+	ssize_t SendQueue::put(const char* data, size_t n)
+	{
+		if (!link)
+			return write(fd, data, n);
+		if (link->stopped.load(std::memory_order_acquire))
+		{
+			errno = EPIPE; //Nobody left to read it
+			return -1;
+		}
+		if (size_t ok = link->send(data, n))
+			return ok;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	void SendQueue::await(int ms)
+	{
+		if (!link)
+		{
+			pollfd pfd{fd, POLLOUT, 0};
+			::poll(&pfd, 1, ms);
+			return;
+		}
+		//The engine takes everything each frame, so room comes soon enough
+		std::this_thread::sleep_for(std::chrono::milliseconds{ms < 0 || ms > 1 ? 1 : ms});
+	}
+
+	void DmxCtl::fadeMaster(size_t sub, size_t mills, float f, FadeCurve curve)
+	{
+		byte b = f * 0xFF;
+		auto msg = message(sub ? 'm' : 'g');
+		if (sub)
+			msg.num(sub, 1);
+		msg.num(mills, 4).hex(b).flag(curveFlag(curve), (int)curve, 1);
+		auto& out = msg.str();
+		send(out);
+	}
+
+	void DmxCtl::sendPatch()
+	{
+		// Identical curves share one table in the child
+		std::map<std::vector<byte>, size_t> ids;
+		std::string msg;
+		for (auto& inst : instruments)
+		for (auto& chan : inst.channels)
+		{
+			if (!chan.response.size())
+				continue;
+
+			auto [it, added] = ids.try_emplace(chan.response, ids.size() + 1);
+			if (added)
+				msg += message('r')
+					.num(it->second, 1)
+					.hex(chan.response.data(), chan.response.size())
+					.str();
+			msg += message('R').num(inst.addr + chan.chanid, 2).num(it->second, 1).str();
+		}
+
+		/* Masters only scale single-byte intensity; scaling a coarse and fine
+		   byte separately would be meaningless. */
+		for (auto& inst : instruments)
+		{
+			auto masterChans = inst[Channel::master];
+			if (masterChans.size() != 1)
+				continue;
+			msg += message('M')
+				.num(inst.addr + masterChans.front()->chanid, 2)
+				.num(inst.submaster.size() ? submasters.at(inst.submaster) : 0, 1)
+				.str();
+		}
+		/* Which slots make up multi-byte values and which hold discrete
+		   values, for the fades the child works out itself, and which it
+		   blacks out on a panic: everything not set to hold. */
+		for (auto& inst : instruments)
+		for (auto& chan : inst.channels)
+		{
+			byte flags = 0;
+			size_t first = chan.chanid;
+			if (std::holds_alternative<std::vector<Channel::DiscreteValue>>(chan.values))
+				flags |= 2;
+			if (!chan.holdOnPanic)
+				flags |= 4;
+			auto parts = inst[chan.name];
+			bool msbFirst;
+			if (parts.size() > 1 && parts.size() <= 3 && coarseFine(parts) &&
+					contiguous(parts, first, msbFirst))
+			{
+				if (first != chan.chanid)
+					continue; //Sent with its first slot
+				flags |= (!msbFirst) | (parts.size() << 4);
+			}
+			if (flags)
+				msg += message('L').num(inst.addr + first, 2).num(flags, 1).str();
+		}
+
+		// Nothing past a universe's last patched channel needs to go on the wire
+		std::vector<size_t> lengths(universes, 1);
+		for (auto& inst : instruments)
+		{
+			size_t u = inst.addr / proto::kSlots;
+			size_t end = inst.addr % proto::kSlots + inst.channels.size();
+			if (end > lengths[u])
+				lengths[u] = end;
+		}
+		for (size_t u = 0; u < universes; u++)
+		{
+			auto n = message('n').num(lengths[u], 2);
+			if (u)
+				n.num(u, 1);
+			msg += n.str();
+		}
+		if (frameRate)
+			msg += message('f').num(frameRate, 2).str();
+
+		send(msg);
 	}
 
 	void DmxCtl::writeOut()
 	{
-		byte slots[512]{0};
+		std::vector<byte> slots;
 		getSlots(slots);
-		constexpr char hexits[] = "0123456789ABCDEF";
-		char hexpair[2];
-		write(tochild, "#", 1);
-		for (auto sl : slots)
+
+		/* What the child doesn't already have, as [first, end) runs.  Runs
+		   taken from shared memory aren't bridged: a slot in between may be
+		   held in a scheduled command, and taking it now would apply it early. */
+		bool useShared = viaShared();
+		size_t gap = useShared ? 0 : 8; //Cheaper to resend than to start a new run
+		std::vector<std::pair<size_t, size_t>> runs;
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			if (slots[i] == sent[i] && !fading[i])
+				continue;
+			if (runs.size() && i - runs.back().second <= gap)
+				runs.back().second = i + 1;
+			else
+				runs.emplace_back(i, i + 1);
+		}
+		if (runs.empty())
+			return;
+		sent = slots;
+		std::fill(fading.begin(), fading.end(), 0);
+
+		std::string msg;
+		if (useShared)
+		{
+			// Only the universes the runs span are copied
+			size_t first = runs.front().first, end = runs.back().second;
+			for (size_t u = first / proto::kSlots; u * proto::kSlots < end; u++)
+			{
+				std::memcpy(shared->desired[u].begin(), &slots[u * proto::kSlots],
+						proto::kSlots);
+				shared->desired[u].publish();
+			}
+			for (auto [first, end] : runs)
+				msg += message('u').num(first, 2).num(end - first, 2).str();
+		}
+		else
 		{
-			hexpair[0] = hexits[sl & 15];
-			hexpair[1] = hexits[sl >> 4];
-			write(tochild, hexpair, 2);
+			for (auto [first, end] : runs)
+				msg += message('@').num(first, 2).hex(&slots[first], end - first).str();
+			std::string frame = message('#').hex(slots.data(), slots.size()).str();
+			if (frame.size() <= msg.size())
+				msg = frame;
 		}
-		write(tochild, "\n", 1);
+		send(msg);
 	}
 
 
@@ -5,12 +5,18 @@
 #include <filesystem>
 #include <vector>
 #include <map>
+#include <deque>
+#include <set>
 #include <variant>
 #include <string>
 #include <sstream>
 #include <stdexcept>
 #include <yaml-cpp/yaml.h>
 #include <chrono>
+#include <memory>
+#include <thread>
+#include "protocol.h"
+#include "engine.h"
 
 
 namespace lsc
@@ -22,6 +28,29 @@ namespace lsc
 
 	struct Unit{};
 
+	// Easing profiles understood by the child; order matches its tables.
+	enum class FadeCurve {
+		linear, scurve, square, log
+	};
+	// Effect waveforms understood by the child; order matches its tables.
+	enum class Waveform {
+		sine, saw, triangle, square, strobe
+	};
+	inline const std::map<std::string, Waveform> waveformMapping{
+		{ "sine",     Waveform::sine     },
+		{ "saw",      Waveform::saw      },
+		{ "triangle", Waveform::triangle },
+		{ "square",   Waveform::square   },
+		{ "strobe",   Waveform::strobe   }
+	};
+
+	inline const std::map<std::string, FadeCurve> fadeCurveMapping{
+		{ "linear", FadeCurve::linear },
+		{ "scurve", FadeCurve::scurve },
+		{ "square", FadeCurve::square },
+		{ "log",    FadeCurve::log    }
+	};
+
 	struct Channel {
 		enum TargetType {
 			master,
@@ -72,6 +101,16 @@ namespace lsc
 		> values;
 
 		byte value;
+		/* Whether the parts of a split value are the coarse and fine bytes of
+		   one number, to be faded as such, rather than separate components
+		   like a colour's.  Pan and tilt are by default. */
+		bool fine = 0;
+		/* Whether a panic leaves the channel where it is rather than taking it
+		   dark.  Pan and tilt hold by default, so moving heads stay put. */
+		bool holdOnPanic = 0;
+		/* Output levels the channel's input range is spread evenly over, or
+		   empty to pass levels straight through. */
+		std::vector<byte> response;
 
 		Channel(size_t c, std::string n, size_t i, TargetType t, Unit u, byte v)
 			: chanid{c}, name{n}, valindex{i}, target{t}, values{u}, value{v} { }
@@ -89,8 +128,9 @@ namespace lsc
 	struct Instrument
 	{
 		std::string name;
-		size_t addr;
+		size_t addr; //Counted across every universe, 512 slots to each
 		std::vector<Channel> channels;
+		std::string submaster; //Empty for none
 
 		Instrument(std::string n, size_t a, std::vector<Channel> c)
 			: name{n}, addr{a}, channels{c} { }
@@ -106,12 +146,56 @@ namespace lsc
 		bool setValue(const std::string&, const std::string&);
 	};
 
+	/* Bytes on their way down a non-blocking fd.  Whatever the fd won't take
+	   yet waits here in order and goes out as it becomes writable, so nothing
+	   is dropped or torn; only a backlog past capacity makes the sender wait,
+	   and then only for so long before the reader is given up for dead. */
+	class SendQueue
+	{
+		static constexpr int kMaxStall = 2000; //ms without taking anything
+
+		std::vector<char> ring;
+		size_t head = 0, used = 0;
+		size_t highWater = 0;
+		size_t stalls = 0; //Times a full queue made push wait
+		size_t discarded = 0; //Bytes nobody was left to take
+
+		// Hands bytes to whichever of fd and link is set, as write(2) would
+		ssize_t put(const char*, size_t);
+		// Waits up to `ms` (-1 for as long as it takes) for room to put more
+		void await(int ms);
+
+	public:
+		int fd = -1;
+		engine::RingLink* link = nullptr; //Instead of fd, for an engine thread
+
+		explicit SendQueue(size_t capacity) : ring(capacity) { }
+
+		void push(const char*, size_t);
+		void push(const std::string& s)
+		{ push(s.data(), s.size()); }
+		// Writes as much as the fd will take.  Returns whether any is left.
+		bool flush();
+		// Waits up to `ms` for everything to go.  Returns whether it did.
+		bool drain(int ms);
+
+		size_t backlog() const { return used; }
+		size_t peak() const { return highWater; }
+		size_t waits() const { return stalls; }
+		size_t lost() const { return discarded; }
+	};
+
 	class DmxCtl : public Controller
 	{
 #ifdef LSC_DEBUGGING_FUNCTION
 		friend LSC_DEBUGGING_FUNCTION;
 #endif
 		std::vector<Instrument> instruments;
+		std::map<std::string, size_t> submasters; //Name to the child's id
+		std::map<std::string, size_t> effects;    //Same
+		size_t universes; //One for each group of outputs
+		unsigned frameRate = 0; //The child's default unless given
+		bool textProtocol = 0;  //Talk to the child in text, for debugging
 
 		//Old:
 		/* This layout should not be modified -- this is an int[2] with named
@@ -127,6 +211,92 @@ namespace lsc
 		int &toparent = toparentpipe[1], &parentin = toparentpipe[0];
 
 		int chid;
+		SendQueue toChild{1 << 20};
+		/* With `engine=thread`, the engine runs in here instead of as
+		   dmxctl-child, and talks to us through `link` rather than pipes. */
+		std::unique_ptr<engine::RingLink> link;
+		std::thread engineThread;
+		std::vector<std::unique_ptr<engine::Sink>> sinks; //When they're ours
+
+		uint32_t nextBatch = 1;
+		uint32_t lastBatch = 0; //The last instruction's
+		std::map<uint32_t, Clock::time_point> unacked; //Batch to when it was sent
+		/* Batches whose fades have all landed: every one before doneBelow, and
+		   those in doneAbove */
+		uint32_t doneBelow = 1;
+		std::set<uint32_t> doneAbove;
+		// Counts a batch as done, whether it finished or never will
+		void retire(uint32_t);
+		/* Panics so far, when the latest was raised, and how long it and the
+		   slowest one took to reach the wire */
+		uint32_t panics = 0;
+		Clock::time_point panicAt{};
+		Clock::duration panicLatency{}, worstPanic{};
+		std::string fromChild; //Partial message
+		bool childGone = 0; //Its pipe has come to an end
+		// Takes in whatever the child has said about batches, without waiting
+		void readChild();
+		proto::Shared* shared = nullptr; //Null if it couldn't be set up
+		/* The universes as the child was last told to set them, and which
+		   slots have been handed to a fade since, so writeOut need only send
+		   the slots the child doesn't already have. */
+		std::vector<byte> sent;
+		std::vector<bool> fading;
+
+		/* Tells the child, once at startup, each channel's response curve,
+		   which submaster each intensity channel is under, and how much of
+		   each universe to send how often. */
+		void sendPatch();
+		Clock::time_point applyAt{}; //Epoch for as soon as the child has it
+
+		/* While instructions are being prepared, what they send is held in the
+		   child's staging slot until a commit.  The model as it was before them
+		   is kept, to go back to if they're discarded instead. */
+		bool staging = 0;
+		struct Model
+		{
+			std::vector<byte> values; //Every channel's, in instrument order
+			std::vector<byte> sent;
+			std::vector<bool> fading;
+			std::map<std::string, size_t> effects;
+			uint32_t lastBatch;
+		};
+		Model beforeStaging;
+		std::vector<uint32_t> stagedBatches;
+
+		/* A command for the child, in whichever protocol it's being sent, and
+		   held by the child until applyAt if that's set */
+		proto::Message message(char op) const
+		{
+			if (staging)
+				return proto::Message::staged(!textProtocol, op);
+			if (applyAt == Clock::time_point{})
+				return proto::Message{!textProtocol, op};
+			return proto::Message{!textProtocol, op, (uint64_t)
+				std::chrono::duration_cast<std::chrono::microseconds>(
+						applyAt.time_since_epoch()
+					).count()};
+		}
+		/* Whether slots can go across through shared memory.  The child reads
+		   them when it applies the `u`, so commands that are staged or held
+		   for later have to carry their values instead. */
+		bool viaShared() const
+		{ return shared && !staging && applyAt == Clock::time_point{}; }
+		// Hands the child a finished command, after any fades held back
+		void send(const std::string&);
+
+		/* While execute runs, fades are held back and gathered into one `F`
+		   command per duration and curve, so they all start on one frame. */
+		struct PendingFades
+		{
+			size_t mills;
+			FadeCurve curve;
+			proto::Message msg;
+		};
+		std::vector<PendingFades> pendingFades;
+		bool batchingFades = 0;
+		proto::Message& fadeBatch(size_t mills, FadeCurve);
+		void flushFades();
 
 
 		//Newly public
@@ -139,7 +309,11 @@ namespace lsc
 		std::string checkScene(const std::string&) const;
 		void loadScene(const std::string&);
 
-		void getSlots(byte (&slots)[512]) const;
+		// Every universe's slots, one after another
+		void getSlots(std::vector<byte>& slots) const;
+		/* What the child is actually sending, fades and masters and all.
+		   Returns 0 if that can't be seen from here. */
+		bool getOutput(std::vector<byte>& slots) const;
 		// Returns whether changes were made
 		bool setValues(Channel::TargetType, float);
 		// Sets each value to {min, max} of itself and float param
@@ -150,7 +324,14 @@ namespace lsc
 		float minValue(Channel::TargetType);
 
 		void setChannel(size_t, byte);
-		void fadeChannel(size_t, size_t mills, byte);
+		void fadeChannel(size_t, size_t mills, byte, FadeCurve = FadeCurve::linear);
+		/* Fades a value split across several channels (`Pan[1]`, `Pan[0]`) as a
+		   single value, so its bytes can't drift apart mid-fade. */
+		void fadeValue(Instrument&, const std::vector<Channel*>&, size_t mills,
+				float, FadeCurve = FadeCurve::linear);
+		/* Fades submaster `sub`, or the grand master for 0.  These scale
+		   intensity on its way out without touching the scene underneath. */
+		void fadeMaster(size_t sub, size_t mills, float, FadeCurve = FadeCurve::linear);
 	//public:
 		DmxCtl(const DmxCtl&) = delete;
 		DmxCtl(std::vector<std::string>);
@@ -167,6 +348,47 @@ namespace lsc
 		std::string state() const override;
 
 		operator bool() const override;
+		// Sends whatever the child's pipe couldn't take earlier
+		void poll() override;
+		// Readable once the child has said something
+		int pollFd() const override;
+
+		/* The child's word that a batch of commands made it out: the number of
+		   the first frame that carried it, and when it was handed over and when
+		   that frame was written. */
+		struct Ack
+		{
+			uint32_t batch;
+			uint32_t frame;
+			Clock::time_point sent, written;
+		};
+		/* Ends a batch of commands, returning the id its Ack will carry.  Every
+		   instruction `execute`s as a batch of its own. */
+		uint32_t mark();
+		// The batch's Ack, or null if it hasn't come (or is too old to keep)
+		const Ack* acked(uint32_t batch);
+		// The latest Ack, or null if there hasn't been one
+		const Ack* lastAck();
+		// The batch of the last instruction `execute`d
+		size_t lastCommand() const override;
+		// Whether all the fades a batch started have landed
+		bool completed(size_t batch) override;
+		// Has the child apply everything sent from here on at `when`
+		void executeAt(Clock::time_point when) override;
+		/* Executes an instruction into the child's staging slot, so that a
+		   `commit` of any size is one small message. */
+		bool prepare(
+				const std::string& inst,
+				const std::vector<std::string>& args
+			) override;
+		void commit() override;
+		void discard() override;
+		/* Raised with the child out of band -- a signal, or the engine thread's
+		   eventfd -- so it's on the wire within a frame whatever's queued. */
+		void panic() override;
+	private:
+		std::deque<Ack> acks; //The most recent, oldest first
+	public:
 
 		~DmxCtl() override;
 
@@ -174,6 +396,10 @@ namespace lsc
 
 		// Previously private.  Now for manual control.
 		void writeOut();
+
+		/* The first `loopback` output, for reading back exactly what was
+		   sent; null unless the engine runs in here and was given one. */
+		engine::LoopbackSink* loopback();
 	};
 
 }
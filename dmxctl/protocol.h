@@ -0,0 +1,300 @@
+#ifndef LSC_DMX_PROTOCOL_H
+#define LSC_DMX_PROTOCOL_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+
+/* What DmxCtl and dmxctl-child say to each other.  Every command is an opcode
+   character followed by fields, and comes either as a line of text (handy for
+   driving the child by hand) or as a binary record:
+
+     kMagic, kVersion, opcode, payload length (2 bytes), payload
+
+   Binary fields come in the same order as the text ones.  Numbers are
+   little-endian and sized per field; byte runs that are hex in text (with each
+   byte's low nybble first) are raw bytes.  Flags that are optional words in
+   text, like `l` and `c<curve>` on a fade, are a single byte in binary. */
+namespace lsc::proto
+{
+	constexpr unsigned char kMagic   = 0xFE; //Can't start a line of text
+	constexpr unsigned char kVersion = 1;
+	constexpr size_t kHeader = 5;
+	constexpr size_t kMaxPayload = 0xFFFF;
+	constexpr size_t kMaxLine = 1 << 17; //Of a text command, newline and all
+
+	constexpr size_t kSlots = 512; //In each universe
+	/* Slots are numbered across every universe, universe u's starting at
+	   u * kSlots, so they still fit a 2-byte field. */
+	constexpr size_t kMaxUniverses = 64;
+
+	inline uint64_t getLE(const unsigned char* p, int width)
+	{
+		uint64_t v = 0;
+		for (int b = width; b--; )
+			v = v << 8 | p[b];
+		return v;
+	}
+
+
+	/* A universe one side writes and the other reads, lock-free, through a
+	   seqlock over two copies.  `seq` is odd while the writer fills the copy
+	   that isn't published, so a reader only has to retry if the writer laps
+	   it. */
+	struct SharedSlots
+	{
+		std::atomic<uint32_t> seq;
+		unsigned char slots[2][kSlots];
+
+		// Writer only: the copy to change, starting out as the published one
+		unsigned char* begin()
+		{
+			uint32_t s = seq.load(std::memory_order_relaxed);
+			seq.store(s + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			unsigned char* next = slots[(s >> 1 & 1) ^ 1];
+			std::memcpy(next, slots[s >> 1 & 1], kSlots);
+			return next;
+		}
+		void publish()
+		{ seq.fetch_add(1, std::memory_order_release); }
+
+		void read(unsigned char* out) const
+		{
+			for (;;)
+			{
+				uint32_t s = seq.load(std::memory_order_acquire);
+				std::memcpy(out, slots[s >> 1 & 1], kSlots);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				//That copy is next written once seq passes the following even
+				if (seq.load(std::memory_order_relaxed) - (s & ~1u) <= 2)
+					return;
+			}
+		}
+	};
+
+	/* Mapped by both processes from a memfd the child is handed as its second
+	   argument.  The parent stores whole universes into `desired` and rings
+	   with a `u` command naming the slots to take; the child mirrors what it
+	   renders into `output`.  Each universe has its own pair, so a change to
+	   one needn't copy the rest. */
+	struct Shared
+	{
+		SharedSlots desired[kMaxUniverses];
+		SharedSlots output[kMaxUniverses];
+	};
+
+
+	/* Bytes from one thread to one other, lock-free, for when the engine runs
+	   in the host's process and there's no pipe between them.  The counts only
+	   ever grow; capacity is a power of two, so they wrap cleanly. */
+	class Ring
+	{
+		std::unique_ptr<char[]> buf;
+		size_t mask;
+		alignas(64) std::atomic<size_t> head{0}; //Taken so far; the consumer's
+		alignas(64) std::atomic<size_t> tail{0}; //Given so far; the producer's
+
+	public:
+		explicit Ring(size_t capacity) : buf{new char[capacity]}, mask{capacity - 1}
+		{ }
+
+		// Producer only: how much a push could take right now
+		size_t room() const
+		{
+			return mask + 1 - (tail.load(std::memory_order_relaxed) -
+					head.load(std::memory_order_acquire));
+		}
+
+		/* Producer only: copies in as much as fits, returning how much.  If
+		   `wasEmpty` is given, it's set when the consumer had taken everything
+		   before this, and so may be asleep waiting to be told. */
+		size_t push(const char* p, size_t n, bool* wasEmpty = nullptr)
+		{
+			size_t t = tail.load(std::memory_order_relaxed);
+			n = std::min(n, room());
+			size_t at = t & mask, run = std::min(n, mask + 1 - at);
+			std::memcpy(buf.get() + at, p, run);
+			std::memcpy(buf.get(), p + run, n - run);
+			//Sequentially consistent with pop, so one of the two sees the other
+			tail.store(t + n, std::memory_order_seq_cst);
+			if (wasEmpty)
+				*wasEmpty = n && head.load(std::memory_order_seq_cst) == t;
+			return n;
+		}
+
+		// Consumer only: copies out as much as there is, returning how much
+		size_t pop(char* p, size_t n)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			n = std::min(n, tail.load(std::memory_order_seq_cst) - h);
+			size_t at = h & mask, run = std::min(n, mask + 1 - at);
+			std::memcpy(p, buf.get() + at, run);
+			std::memcpy(p + run, buf.get(), n - run);
+			head.store(h + n, std::memory_order_seq_cst);
+			return n;
+		}
+	};
+
+
+	// Builds one command in either form, a field at a time.
+	class Message
+	{
+		std::string out;
+		bool binary;
+		bool first; //Text puts no space before the first field
+
+		void sep()
+		{
+			if (!binary && !first)
+				out += ' ';
+			first = 0;
+		}
+
+	public:
+		/* A command for the child to hold until `at`, in us on the steady
+		   clock: `t<at> <command>` in text, or a `t` record whose payload is
+		   `at` (8 bytes), the command's opcode and then its payload. */
+		Message(bool bin, char op, uint64_t at) : Message{bin, 't'}
+		{
+			if (binary)
+				num(at, 8);
+			else
+			{
+				out += std::to_string(at);
+				out += ' ';
+			}
+			out += op;
+		}
+
+		/* A command for the child to hold in its staging slot until a `G`:
+		   `P<command>` in text, or a `P` record whose payload is the command's
+		   opcode and then its payload. */
+		static Message staged(bool bin, char op)
+		{
+			Message m{bin, 'P'};
+			m.out += op;
+			return m;
+		}
+
+		Message(bool bin, char op) : out{}, binary{bin}, first{1}
+		{
+			if (binary)
+			{
+				out += (char)kMagic;
+				out += (char)kVersion;
+				out += op;
+				out.append(2, '\0'); //Length, filled in by str()
+			}
+			else
+				out += op;
+		}
+
+		Message& num(uint64_t v, int width)
+		{
+			sep();
+			if (binary)
+				for (int b = 0; b < width; b++)
+					out += (char)(v >> 8*b);
+			else
+				out += std::to_string(v);
+			return *this;
+		}
+
+		Message& hex(const unsigned char* p, size_t n)
+		{
+			constexpr char hexits[] = "0123456789ABCDEF";
+			sep();
+			if (binary)
+				out.append((const char*)p, n);
+			else
+				for (size_t i = 0; i < n; i++)
+				{
+					out += hexits[p[i] & 15];
+					out += hexits[p[i] >> 4];
+				}
+			return *this;
+		}
+		Message& hex(unsigned char b)
+		{ return hex(&b, 1); }
+
+		// A field spelled `text` (or left out, if empty) in text form
+		Message& flag(const std::string& text, uint32_t v, int width)
+		{
+			if (binary)
+				return num(v, width);
+			if (text.size())
+			{
+				sep();
+				out += text;
+			}
+			return *this;
+		}
+
+		// An effect member: <slot>/<phase> in text
+		Message& member(uint32_t slot, uint32_t phase)
+		{
+			if (binary)
+				return num(slot, 2).num(phase, 2);
+			sep();
+			out += std::to_string(slot);
+			out += '/';
+			out += std::to_string(phase);
+			return *this;
+		}
+
+		/* One fade in a bulk fade: its first slot and target bytes in slot
+		   order, as <slot>=<hex>[l] in text */
+		Message& target(uint32_t slot, const unsigned char* p, int w, bool lsb)
+		{
+			if (binary)
+				return num(slot, 2).num(lsb | w << 4, 1).hex(p, w);
+			sep();
+			out += std::to_string(slot);
+			out += '=';
+			first = 1;
+			hex(p, w);
+			if (lsb)
+				out += 'l';
+			return *this;
+		}
+
+		// Whether `more` bytes of fields could still go in one command
+		bool fits(size_t more) const
+		{
+			return binary ? out.size() - kHeader + more <= kMaxPayload
+				: out.size() + more < kMaxLine;
+		}
+
+		/* The finished command, ready to be written.  One too long for the
+		   child to take is refused rather than sent garbled. */
+		const std::string& str()
+		{
+			if (binary)
+			{
+				size_t len = out.size() - kHeader;
+				if (len > kMaxPayload)
+					throw std::length_error("command payload too long");
+				out[3] = len & 0xFF;
+				out[4] = len >> 8;
+			}
+			else
+			{
+				if (out.back() != '\n')
+					out += '\n';
+				if (out.size() > kMaxLine)
+					throw std::length_error("command line too long");
+			}
+			return out;
+		}
+	};
+}
+
+
+#endif
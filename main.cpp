@@ -25,6 +25,7 @@ public:
 	std::string state() const { return "good"; }
 	std::string verify(const std::string& inst, const std::vector<std::string>& args) { return ""; }
 	operator bool() const { return 1; }
+	bool prepare(const std::string& inst, const std::vector<std::string>& args) { return 1; }
 };
 
 struct Instruction
@@ -118,6 +119,36 @@ int main(int argc, char** argv)
 
 	auto isp = instructions.begin();
 	bool moved = 1;
+	/* The steps from `armed` up to `armedEnd` are prepared in their
+	   controllers, ready to go on the next GO, but for those in `live`, which
+	   couldn't be and are executed then instead. */
+	auto armed = instructions.end(), armedEnd = armed;
+	std::vector<decltype(armed)> live;
+	/* A `->` step waits for the one before it to be over, checked each tick
+	   so the keys still work meanwhile.  A GO goes ahead without it. */
+	lsc::Controller* waitingOn = nullptr;
+	// Runs the steps that follow on from the one just gone, up to a wait
+	auto runFollowing = [&]
+	{
+		while (isp != instructions.end() && isp->timing != Instruction::enter)
+		{
+			if (isp->timing == Instruction::after)
+			{
+				//Once the previous step is over, e.g. its fades have landed
+				auto prev = cons[(isp-1)->handler];
+				if (!prev->completed(prev->lastCommand()))
+				{
+					waitingOn = prev;
+					return;
+				}
+				for (auto& con : cons)
+					con.second->executeAt(Clock::now() + 5ms);
+			}
+			cons[isp->handler]->execute(isp->command, isp->args);
+			++isp;
+			moved = 1;
+		}
+	};
 
 	std::cout << "\x1B[s\x1B[?25l"; //Save pos, and hide curs
 	const auto tick = 50ms;
@@ -127,8 +158,35 @@ int main(int argc, char** argv)
 		if (isp == instructions.end())
 			isp = instructions.begin();
 		//Make sure loop starts steadily, no matter how long each particular
-		//goround takes.
-		std::this_thread::sleep_until(next += tick);
+		//goround takes.  A controller with news wakes it early, so a `->` step
+		//goes as soon as the one before it is over.
+		std::vector<pollfd> fds;
+		for (auto& con : cons)
+			if (int fd = con.second->pollFd(); fd != -1)
+				fds.push_back({fd, POLLIN, 0});
+		auto wait = std::chrono::ceil<std::chrono::milliseconds>(next - Clock::now());
+		if (poll(fds.data(), fds.size(), std::max<int>(wait.count(), 0)) <= 0)
+			next += tick;
+		for (auto& con : cons)
+			con.second->poll();
+		if (waitingOn && waitingOn->completed(waitingOn->lastCommand()))
+		{
+			waitingOn = nullptr;
+			runFollowing();
+			for (auto& con : cons)
+				con.second->executeAt({});
+		}
+		if (!waitingOn && armed != isp)
+		{
+			for (auto& con : cons)
+				con.second->discard();
+			armed = armedEnd = isp;
+			live.clear();
+			for ( ; armedEnd != instructions.end()
+				&& (armedEnd == isp || armedEnd->timing == Instruction::simul); ++armedEnd)
+				if (!cons[armedEnd->handler]->prepare(armedEnd->command, armedEnd->args))
+					live.push_back(armedEnd);
+		}
 		if (moved)
 		{
 			moved = 0;
@@ -234,7 +292,27 @@ int main(int argc, char** argv)
 			{
 			case '\n':
 			case ' ':
-				if (isp != instructions.end())
+				waitingOn = nullptr;
+				//Steps that go together land together, just after the GO
+				for (auto& con : cons)
+					con.second->executeAt(Clock::now() + 5ms);
+				if (armed == isp && armedEnd != isp)
+				{
+					for (auto& con : cons)
+						con.second->commit();
+					for (auto step : live)
+					{
+						try {
+							cons[step->handler]->execute(step->command, step->args);
+						} catch (std::domain_error e) {
+							std::cerr << e.what() << '\n';
+							return 2;
+						}
+					}
+					isp = armedEnd;
+					moved = 1;
+				}
+				else if (isp != instructions.end())
 				{
 					try {
 						cons[isp->handler]->execute(isp->command, isp->args);
@@ -247,20 +325,9 @@ int main(int argc, char** argv)
 					++isp;
 					moved = 1;
 				}
-				while (isp != instructions.end() && isp->timing != Instruction::enter)
-				{
-					switch (isp->timing)
-					{
-					case Instruction::after:
-						//TODO: make not rarted
-						std::this_thread::sleep_for(1800ms);
-					case Instruction::simul:
-						cons[isp->handler]->execute(isp->command, isp->args);
-						++isp;
-						moved = 1;
-						break;
-					}
-				}
+				runFollowing();
+				for (auto& con : cons)
+					con.second->executeAt({});
 
 				break;
 			case '\b':
@@ -271,6 +338,7 @@ int main(int argc, char** argv)
 				{
 					--isp;
 					moved = 1;
+					waitingOn = nullptr;
 				}
 				break;
 			case 's':
@@ -279,12 +347,20 @@ int main(int argc, char** argv)
 				{
 					++isp;
 					moved = 1;
+					waitingOn = nullptr;
 				}
 				break;
 			case 'r':
 				//TODO: reee
 				isp = instructions.begin();
 				moved = 1;
+				waitingOn = nullptr;
+				break;
+			case 'p':
+				for (auto& con : cons)
+					con.second->panic();
+				armed = instructions.end(); //Whatever was prepared is gone
+				waitingOn = nullptr; //Nor does what was waiting go on by itself
 				break;
 			case 'q':
 				running = 0;